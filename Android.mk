@@ -15,7 +15,12 @@ LOCAL_SRC_FILES := \
 	sanity.c \
 	keystore.c \
 	asn1.c \
-	hashes.c
+	hashes.c \
+	efivar_cache.c \
+	logger.c \
+	xfer_stats.c \
+	digest.c \
+	fat.c
 
 LOCAL_CFLAGS := -DDEVICE_NAME=\"$(TARGET_BOOTLOADER_BOARD_NAME)\" \
 	-W -Wall -Wextra -Wno-unused-parameter -Wno-format-zero-length -Werror
@@ -46,6 +46,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <linux/input.h>
 #include <sys/utsname.h>
 #include <sys/klog.h>
@@ -71,6 +72,8 @@
 #include "sanity.h"
 #include "keystore.h"
 #include "hashes.h"
+#include "efivar_cache.h"
+#include "xfer_stats.h"
 
 /* Generated by the makefile, this function defines the
  * register_userfastboot_plugins() function, which calls all the
@@ -239,8 +242,9 @@ static bool is_provisioning_mode(void)
 	static int provisioning_state;
 
 	if (!provisioning_state) {
-		ret = efi_get_variable(fastboot_guid, OEM_LOCK_VAR, (uint8_t **)&data,
-				       &dsize, &attributes);
+		ret = efi_cache_get_variable(fastboot_guid, OEM_LOCK_VAR,
+					     (uint8_t **)&data, &dsize,
+					     &attributes);
 		if (ret || !dsize) {
 			/* If the variable does not exist, assume this is an
 			 * unlocked, non-provisioned device. We will be in
@@ -271,7 +275,7 @@ static enum device_state get_device_state(void)
 		goto out;
 	}
 
-	ret = efi_get_variable(fastboot_guid, OEM_LOCK_VAR, (uint8_t **)&data,
+	ret = efi_cache_get_variable(fastboot_guid, OEM_LOCK_VAR, (uint8_t **)&data,
 			&dsize, &attributes);
 	if (ret || !dsize) {
 		/* If the variable does not exist, assume this is an
@@ -320,7 +324,7 @@ static void fetch_boot_state(void)
 	efi_guid_t fastboot_guid = FASTBOOT_GUID;
 	char *state;
 
-	ret = efi_get_variable(fastboot_guid, BOOT_STATE_VAR, (uint8_t **)&data,
+	ret = efi_cache_get_variable(fastboot_guid, BOOT_STATE_VAR, (uint8_t **)&data,
 			&dsize, &attributes);
 	if (ret || dsize != 1) {
 		pr_debug("Couldn't read boot state\n");
@@ -356,8 +360,8 @@ static int efi_get_variable_byte(efi_guid_t guid, char *varname, char *value)
 	size_t dsize;
 	uint32_t attributes;
 
-	ret = efi_get_variable(guid, varname, (uint8_t **)&data,
-			       &dsize, &attributes);
+	ret = efi_cache_get_variable(guid, varname, (uint8_t **)&data,
+				     &dsize, &attributes);
 	if (ret || !dsize) {
 		pr_debug("Failed to read byte variable %s\n", varname);
 		ret = -1;
@@ -582,6 +586,7 @@ static int set_device_state(enum device_state device_state)
 		pr_status("Userdata erase required, this can take a while...\n");
 		fastboot_info("Userdata erase required, this can take a while...\n");
 
+		hash_cache_invalidate("data");
 		if (erase_partition(vol)) {
 			pr_error("couldn't erase data partition\n");
 			return -1;
@@ -591,7 +596,7 @@ static int set_device_state(enum device_state device_state)
 #endif
 	}
 
-	ret = efi_set_variable(fastboot_guid, OEM_LOCK_VAR,
+	ret = efi_cache_set_variable(fastboot_guid, OEM_LOCK_VAR,
 			&statevar, sizeof(statevar),
 			EFI_VARIABLE_NON_VOLATILE |
 			EFI_VARIABLE_RUNTIME_ACCESS |
@@ -718,7 +723,7 @@ static int set_keystore_data(void *data, unsigned sz)
 		free_keystore(ks);
 	}
 
-	ret = efi_set_variable(fastboot_guid, KEYSTORE_VAR,
+	ret = efi_cache_set_variable(fastboot_guid, KEYSTORE_VAR,
 			data, sz,
 			EFI_VARIABLE_NON_VOLATILE |
 			EFI_VARIABLE_RUNTIME_ACCESS |
@@ -765,6 +770,7 @@ static void cmd_erase(char *part_name, int fd, void *data, unsigned sz)
 	}
 
 	pr_status("Erasing %s, this can take a while...\n", part_name);
+	hash_cache_invalidate(part_name);
 	if (erase_partition(vol))
 		fastboot_fail("Can't erase partition");
 	else
@@ -818,7 +824,9 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 
 		cb = (flash_func)cs->callback;
 
+		/* We don't know what a flash function touches */
 		cbret = cb(tgt.params, fd, data, sz);
+		hash_cache_invalidate(NULL);
 		if (cbret) {
 			pr_error("%s flash failed!\n", tgt.name);
 			fastboot_fail("%s", tgt.name);
@@ -874,6 +882,8 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 	if (sz >= sizeof(magic))
 		memcpy(&magic, data, sizeof(magic));
 
+	hash_cache_invalidate(tgt.name);
+
 	if (magic == SPARSE_HEADER_MAGIC) {
 		/* If there is enough data to hold the header,
 		 * and MAGIC appears in header,
@@ -1219,13 +1229,53 @@ out:
 }
 
 
+/* One line of an oemvars file. Nothing is written until the whole file
+ * has parsed. */
+struct oemvar_update {
+	efi_guid_t guid;
+	char *name;
+	char *val;		/* NULL to clear the variable */
+	size_t len;
+	uint32_t attributes;
+	int lineno;
+};
+
+/* Whether a variable already holds what an oemvars line would write, so
+ * we can skip a slow flash write through the firmware */
+static bool oemvar_unchanged(struct oemvar_update *u)
+{
+	uint8_t *cur = NULL;
+	size_t cur_len;
+	uint32_t cur_attributes;
+	bool ret;
+
+	/* Authenticated writes carry a signed payload rather than the
+	 * value, and boot service variables can't be read back from here */
+	if ((u->attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) ||
+			!(u->attributes & EFI_VARIABLE_RUNTIME_ACCESS))
+		return false;
+
+	if (efi_cache_get_variable(u->guid, u->name, &cur, &cur_len,
+				&cur_attributes))
+		return !u->val && errno == ENOENT;
+
+	ret = u->val && cur_len == u->len &&
+		cur_attributes == u->attributes &&
+		!memcmp(cur, u->val, u->len);
+	free(cur);
+	return ret;
+}
+
 static int cmd_flash_oemvars(Hashmap *params, int fd, void *data, unsigned sz)
 {
-        int ret = -1;
+	int ret = -1;
 	char *buf, *line, *eol, *var, *val, *p;
 	size_t vallen;
 	efi_guid_t curr_guid = LOADER_GUID;
 	int lineno = 0;
+	struct oemvar_update *updates = NULL;
+	int count = 0;
+	int i, set = 0, cleared = 0, unchanged = 0;
 
 	pr_info("Parsing and setting values from oemvars file\n");
 
@@ -1239,6 +1289,7 @@ static int cmd_flash_oemvars(Hashmap *params, int fd, void *data, unsigned sz)
 	for (line = buf; line - buf < (ssize_t)sz; line = eol+1) {
 		uint32_t attributes;
 		enum vartype type;
+		struct oemvar_update *u;
 
 		lineno++;
 
@@ -1289,7 +1340,6 @@ static int cmd_flash_oemvars(Hashmap *params, int fd, void *data, unsigned sz)
 			continue;
 
 		if (val) {
-			pr_info("Setting oemvar: %s\n", var);
 			switch (type) {
 			case VAR_TYPE_BLOB:
 				vallen = unescape_oemvar_val(val) - 1;
@@ -1301,21 +1351,51 @@ static int cmd_flash_oemvars(Hashmap *params, int fd, void *data, unsigned sz)
 				goto out;
 			}
 		} else {
-			pr_info("Clearing oemvar: %s\n", var);
 			vallen = 0;
 		}
 
-		if (efi_set_variable(curr_guid, var, (uint8_t *)val,
-					vallen, attributes)) {
+		updates = xrealloc(updates, (count + 1) * sizeof(*updates));
+		u = &updates[count++];
+		u->guid = curr_guid;
+		u->name = var;
+		u->val = val;
+		u->len = vallen;
+		u->attributes = attributes;
+		u->lineno = lineno;
+	}
+
+	/* Only touch what differs, each write is a trip to SPI flash */
+	for (i = 0; i < count; i++) {
+		struct oemvar_update *u = &updates[i];
+
+		if (oemvar_unchanged(u)) {
+			pr_debug("oemvar %s unchanged\n", u->name);
+			unchanged++;
+			continue;
+		}
+
+		pr_info("%s oemvar: %s\n", u->val ? "Setting" : "Clearing",
+				u->name);
+		if (u->val)
+			set++;
+		else
+			cleared++;
+		if (efi_cache_set_variable(u->guid, u->name, (uint8_t *)u->val,
+					u->len, u->attributes)) {
 			pr_error("EFI variable setting failed\n");
+			lineno = u->lineno;
 			goto out;
 		}
-
 	}
+	pr_info("oemvars: %d set, %d cleared, %d unchanged\n",
+			set, cleared, unchanged);
 	ret = 0;
 out:
-	fastboot_publish("secureboot", xstrdup(is_secure_boot_enabled()));
+	/* Writing keys can change SecureBoot and SetupMode as well */
+	if (set || cleared)
+		efi_cache_invalidate();
 	populate_status_info();
+	free(updates);
 	free(buf);
 	if (ret)
 		pr_error("Failed at line %d\n", lineno);
@@ -1385,6 +1465,7 @@ static int garbage_disk(int argc, char **argv)
 	}
 
 	pr_status("Trashing %s contents...this can take a while", disk_name);
+	hash_cache_invalidate(NULL);
 
 	/* Get a big blob of pseudo-random data to write over and over again */
 	buf = xmalloc(CHUNK);
@@ -1400,6 +1481,7 @@ static int garbage_disk(int argc, char **argv)
 	}
 
 	mui_show_progress(1.0, 0);
+	xfer_start(XFER_ERASE, disk_size);
 	while (remaining_disk) {
 		ssize_t written, to_write;
 
@@ -1412,6 +1494,7 @@ static int garbage_disk(int argc, char **argv)
 			goto out;
 		}
 		remaining_disk -= written;
+		xfer_add(XFER_ERASE, written, 0);
 	}
 	ret = 0;
 out:
@@ -1419,6 +1502,7 @@ out:
 		close(ifd);
 	if (ofd >= 0)
 		close(ofd);
+	xfer_finish(XFER_ERASE);
 	mui_reset_progress();
 	free(disk_name);
 	free(buf);
@@ -1427,6 +1511,44 @@ out:
 }
 
 
+#define DEFAULT_ERASE_SAMPLES	4096
+
+static int oem_verify_erase(int argc, char **argv)
+{
+	struct fstab_rec *vol;
+	unsigned long long samples = DEFAULT_ERASE_SAMPLES;
+	char *end;
+
+	if (argc < 2 || argc > 3) {
+		pr_error("usage: verify-erase <partition> [samples]\n");
+		return -1;
+	}
+
+	if (argc == 3) {
+		errno = 0;
+		samples = strtoull(argv[2], &end, 10);
+		if (errno || *end || end == argv[2] || argv[2][0] == '-' ||
+				!samples || samples > UINT_MAX) {
+			pr_error("invalid sample count '%s'\n", argv[2]);
+			return -1;
+		}
+	}
+
+	vol = volume_for_name(argv[1]);
+	if (!vol) {
+		pr_error("unknown partition name '%s'\n", argv[1]);
+		return -1;
+	}
+
+	if (!is_valid_blkdev(vol->blk_device)) {
+		pr_error("invalid destination node. partition disks?\n");
+		return -1;
+	}
+
+	return verify_erased_partition(vol, samples);
+}
+
+
 static int set_efi_var(int argc, char **argv)
 {
 	int ret = 0;
@@ -1443,7 +1565,7 @@ static int set_efi_var(int argc, char **argv)
 
 	if (argc == 3) {
 		pr_debug("Setting '%s' to value '%s'\n", argv[1], argv[2]);
-		ret = efi_set_variable(loader_guid, argv[1],
+		ret = efi_cache_set_variable(loader_guid, argv[1],
 				(uint8_t *)argv[2], strlen(argv[2]) + 1,
 				EFI_VARIABLE_NON_VOLATILE |
 				EFI_VARIABLE_RUNTIME_ACCESS |
@@ -1454,9 +1576,9 @@ static int set_efi_var(int argc, char **argv)
 	} else {
 		pr_debug("Clearing '%s'\n", argv[1]);
         /* If variable is already cleared, this call will return 'false' */
-		readEFI = efi_get_variable(loader_guid, argv[1], &data, &data_size, &attributes);
+		readEFI = efi_cache_get_variable(loader_guid, argv[1], &data, &data_size, &attributes);
 		if (!readEFI){
-			ret = efi_set_variable(loader_guid, argv[1],
+			ret = efi_cache_set_variable(loader_guid, argv[1],
 				(uint8_t *)NULL, 0,
 				EFI_VARIABLE_NON_VOLATILE |
 				EFI_VARIABLE_RUNTIME_ACCESS |
@@ -1487,7 +1609,7 @@ static int set_fastboot_toggle_value(int argc, char **argv, char *var)
 		return -1;
 	}
 
-	return efi_set_variable(fastboot_guid, var,
+	return efi_cache_set_variable(fastboot_guid, var,
 			(uint8_t *)argv[1], strlen(argv[1]) + 1,
 			EFI_VARIABLE_NON_VOLATILE |
 			EFI_VARIABLE_RUNTIME_ACCESS |
@@ -1497,14 +1619,7 @@ static int set_fastboot_toggle_value(int argc, char **argv, char *var)
 
 static int oem_off_mode_charge(int argc, char **argv)
 {
-	int ret;
-
-	ret = set_fastboot_toggle_value(argc, argv, OFF_MODE_CHARGE);
-
-	if (!ret)
-		fastboot_publish(OFF_MODE_CHARGE, xstrdup(argv[1]));
-
-	return ret;
+	return set_fastboot_toggle_value(argc, argv, OFF_MODE_CHARGE);
 }
 
 
@@ -1545,17 +1660,16 @@ static int oem_showtext(int argc, char **argv)
 }
 
 #ifndef USER
-#define MAX_INFO_LEN	59
 #define FALLBACK_KLOG_BUF_SHIFT	17	/* CONFIG_LOG_BUF_SHIFT from our kernel */
 #define FALLBACK_KLOG_BUF_LEN	(1 << FALLBACK_KLOG_BUF_SHIFT)
 
 static int oem_dmesg(int argc, char **argv)
 {
 	char *buf, *str, *saveptr, *line;
-	char linebuf[MAX_INFO_LEN + 1];
 	int buf_sz, ret;
 
-	linebuf[MAX_INFO_LEN] = '\0';
+	/* Include whatever is still queued for the kernel log */
+	logger_flush();
 
 	/* Don't know why this fails, backup numbers taken from toolbox */
 	buf_sz = klogctl(KLOG_SIZE_BUFFER, 0, 0);
@@ -1579,12 +1693,7 @@ static int oem_dmesg(int argc, char **argv)
 		if (line == NULL)
 			break;
 
-		while (strlen(line) > MAX_INFO_LEN) {
-			strncpy(linebuf, line, MAX_INFO_LEN);
-			fastboot_info(linebuf);
-			line += MAX_INFO_LEN;
-		}
-		fastboot_info(line);
+		fastboot_report("%s", line);
 	}
 	free(buf);
 	return 0;
@@ -1593,26 +1702,116 @@ static int oem_dmesg(int argc, char **argv)
 
 static int oem_get_hashes(int argc, char **argv)
 {
-	int ret = 0;
+	static char *default_ptns[] = { "boot", "recovery", "bootloader",
+		"system" };
+	const struct digest_alg *alg;
+	int ret;
 
-	ret |= get_boot_image_hash("boot");
-	ret |= get_boot_image_hash("recovery");
-	ret |= get_fat_file_hashes("bootloader");
-	ret |= get_ext_image_hash("system");
+	/* get-hashes [sha1|sha256|crc32|crc32c|xxh64] [partition...] */
+	argc--;
+	argv++;
+	alg = argc ? digest_alg_by_name(argv[0]) : NULL;
+	if (alg) {
+		argc--;
+		argv++;
+	} else if (argc && !volume_for_name(argv[0])) {
+		/* Most likely a misspelled algorithm, don't go looking
+		 * for a partition by that name */
+		pr_error("Unknown digest algorithm '%s'\n", argv[0]);
+		return -1;
+	} else {
+		alg = digest_alg_default();
+	}
 
+	if (!argc) {
+		argv = default_ptns;
+		argc = sizeof(default_ptns) / sizeof(default_ptns[0]);
+	}
+
+	ret = get_partition_hashes(argv, argc, alg);
 	if (ret)
 		pr_error("Some images failed inspection\n");
 
 	return ret;
 }
 
+static int oem_checksum(int argc, char **argv)
+{
+	uint64_t offset = 0, len = 0;
+	char *end;
+
+	if (argc != 2 && argc != 4) {
+		pr_error("Usage: checksum <partition> [offset len]\n");
+		return -1;
+	}
+
+	if (argc == 4) {
+		errno = 0;
+		offset = strtoull(argv[2], &end, 0);
+		if (errno || *end || end == argv[2]) {
+			pr_error("bad offset '%s'\n", argv[2]);
+			return -1;
+		}
+		len = strtoull(argv[3], &end, 0);
+		if (errno || *end || end == argv[3]) {
+			pr_error("bad length '%s'\n", argv[3]);
+			return -1;
+		}
+	}
+
+	return checksum_partition(argv[1], offset, len);
+}
+
+static int oem_loglevel(int argc, char **argv)
+{
+	char *end;
+	long level;
+
+	if (argc == 1) {
+		fastboot_report("loglevel: %d", logger_get_level());
+		return 0;
+	}
+
+	if (argc == 2) {
+		level = strtol(argv[1], &end, 10);
+		if (!*end && end != argv[1] && level >= 0 && level <= 7) {
+			logger_set_level(level);
+			return 0;
+		}
+	}
+
+	pr_error("Usage: loglevel [0-7]\n");
+	return -1;
+}
+
+static int oem_stage(int argc, char **argv)
+{
+	if (argc != 2 || (strcmp(argv[1], "on") && strcmp(argv[1], "off"))) {
+		pr_error("Usage: stage on|off\n");
+		return -1;
+	}
+
+	fastboot_set_staging(!strcmp(argv[1], "on"));
+	return 0;
+}
+
+static int oem_verify_verity(int argc, char **argv)
+{
+	if (argc > 2) {
+		pr_error("Usage: verify-verity [partition]\n");
+		return -1;
+	}
+
+	return verify_ext_image_verity(argc == 2 ? argv[1] : "system");
+}
+
 
 #ifndef USER
 static int oem_clear_lock(int argc, char **argv)
 {
 	efi_guid_t fastboot_guid = FASTBOOT_GUID;
 
-	if (efi_set_variable(fastboot_guid, OEM_LOCK_VAR, 0, 0, 0) < 0) {
+	if (efi_cache_set_variable(fastboot_guid, OEM_LOCK_VAR, 0, 0, 0) < 0) {
 		fastboot_fail("couldn't reset provisioning state");
 		return -1;
 	}
@@ -1634,11 +1833,18 @@ static void publish_from_prop(char *key, char *prop, char *dfl)
 
 void populate_status_info(void)
 {
+	static char *keys[] = { "product", "version-bootloader", "kernel",
+		"firmware", "board", "serialno", "device-state", "secureboot",
+		"boot-state", "provisioning-mode" };
+	char *values[sizeof(keys) / sizeof(keys[0])];
 	char *interface_info;
 	char *infostring;
+	unsigned int i;
 
 	pr_debug("updating status text\n");
 	interface_info = get_network_interface_status();
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+		values[i] = fastboot_getvar(keys[i]);
 
 	infostring = xasprintf("Userfastboot for %s\n \n"
 		     "       bootloader: %s\n"
@@ -1651,21 +1857,15 @@ void populate_status_info(void)
 		     "       boot state: %s\n"
 		     "provisioning mode: %s\n"
 		     " \n%s",
-		     fastboot_getvar("product"),
-		     fastboot_getvar("version-bootloader"),
-		     fastboot_getvar("kernel"),
-		     fastboot_getvar("firmware"),
-		     fastboot_getvar("board"),
-		     fastboot_getvar("serialno"),
-		     fastboot_getvar("device-state"),
-		     fastboot_getvar("secureboot"),
-		     fastboot_getvar("boot-state"),
-		     fastboot_getvar("provisioning-mode"),
+		     values[0], values[1], values[2], values[3], values[4],
+		     values[5], values[6], values[7], values[8], values[9],
 		     interface_info);
 	pr_debug("%s", infostring);
 	mui_infotext(infostring);
 	free(infostring);
 	free(interface_info);
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+		free(values[i]);
 }
 
 
@@ -1694,7 +1894,7 @@ static char *get_loader_version(void)
 	size_t dsize;
 	uint32_t attributes;
 
-	ret = efi_get_variable(loader_guid, LOADER_VERSION_VAR, (uint8_t **)&data16,
+	ret = efi_cache_get_variable(loader_guid, LOADER_VERSION_VAR, (uint8_t **)&data16,
 			&dsize, &attributes);
 	if (ret || !dsize || dsize % 2 != 0)
 		return xstrdup("unknown+userfastboot-" USERFASTBOOT_VERSION);
@@ -1719,20 +1919,34 @@ static char *get_loader_version(void)
 }
 
 
-static char *get_off_mode_charge(void)
+static char *get_off_mode_charge(const char *name, void *ctx)
 {
 	char *data = NULL;
+	char *value;
 	size_t dsize;
 	uint32_t attributes;
 	int ret;
 	efi_guid_t loader_guid = FASTBOOT_GUID;
 
-	ret = efi_get_variable(loader_guid, OFF_MODE_CHARGE, (uint8_t **)&data,
+	ret = efi_cache_get_variable(loader_guid, OFF_MODE_CHARGE, (uint8_t **)&data,
 			&dsize, &attributes);
-	if (ret || !data || !dsize)
+	if (ret || !data || !dsize) {
+		free(data);
 		return xstrdup("1");
+	}
+
+	/* Normally stored with its terminator, but don't rely on it */
+	value = xmalloc(dsize + 1);
+	memcpy(value, data, dsize);
+	value[dsize] = '\0';
+	free(data);
+	return value;
+}
+
 
-	return xstrdup(data);
+static char *get_secureboot(const char *name, void *ctx)
+{
+	return xstrdup(is_secure_boot_enabled());
 }
 
 
@@ -1770,7 +1984,7 @@ void aboot_register_commands(void)
 	 * XXX need to reconcile this with Verifiedbootflow.pdf */
 	fastboot_publish("secure", xstrdup("no"));
 
-	fastboot_publish("secureboot", xstrdup(is_secure_boot_enabled()));
+	fastboot_publish_getter("secureboot", get_secureboot, NULL, 0);
 	fastboot_publish("provisioning-mode", xstrdup(provisioning ? "yes" : "no"));
 
 	bios_vendor = get_dmi_data("bios_vendor");
@@ -1795,7 +2009,8 @@ void aboot_register_commands(void)
 	else
 		fastboot_publish("kernel", xstrdup("unknown"));
 
-	fastboot_publish(OFF_MODE_CHARGE, get_off_mode_charge());
+	fastboot_publish_getter(OFF_MODE_CHARGE, get_off_mode_charge, NULL, 0);
+	xfer_stats_init();
 
 	fastboot_register("boot", cmd_boot);
 	fastboot_register("erase:", cmd_erase);
@@ -1808,12 +2023,18 @@ void aboot_register_commands(void)
 	aboot_register_flash_cmd("ifwi", cmd_flash_ifwi, UNLOCKED);
 
 	aboot_register_oem_cmd("garbage-disk", garbage_disk, UNLOCKED);
+	aboot_register_oem_cmd("gpt", oem_gpt, UNLOCKED);
+	aboot_register_oem_cmd("verify-erase", oem_verify_erase, VERIFIED);
 	aboot_register_oem_cmd("setvar", set_efi_var, UNLOCKED);
 	aboot_register_oem_cmd("reboot", oem_reboot_cmd, LOCKED);
 	aboot_register_oem_cmd("showtext", oem_showtext, LOCKED);
 	aboot_register_oem_cmd("hidetext", oem_hidetext, LOCKED);
 	aboot_register_oem_cmd("off-mode-charge", oem_off_mode_charge, UNLOCKED);
 	aboot_register_oem_cmd("get-hashes", oem_get_hashes, LOCKED);
+	aboot_register_oem_cmd("checksum", oem_checksum, LOCKED);
+	aboot_register_oem_cmd("verify-verity", oem_verify_verity, LOCKED);
+	aboot_register_oem_cmd("stage", oem_stage, LOCKED);
+	aboot_register_oem_cmd("loglevel", oem_loglevel, LOCKED);
 	aboot_register_oem_cmd("audiodebug", oem_audio_debug, UNLOCKED);
 
 #ifndef USER
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <gpt/checksum.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI
+#endif
+
+#include "digest.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+static void sha1_init(union digest_state *st)
+{
+	SHA1_Init(&st->sha1);
+}
+
+static void sha1_update(union digest_state *st, const void *data, size_t len)
+{
+	SHA1_Update(&st->sha1, data, len);
+}
+
+static void sha1_final(union digest_state *st, unsigned char *out)
+{
+	SHA1_Final(out, &st->sha1);
+}
+
+static void sha256_init(union digest_state *st)
+{
+	SHA256_Init(&st->sha256);
+}
+
+static void sha256_update(union digest_state *st, const void *data, size_t len)
+{
+	SHA256_Update(&st->sha256, data, len);
+}
+
+static void sha256_final(union digest_state *st, unsigned char *out)
+{
+	SHA256_Final(out, &st->sha256);
+}
+
+/* The CRCs and xxHash come from libgpt, which has the accelerated
+ * implementations */
+static void crc32_init(union digest_state *st)
+{
+	st->crc = 0;
+}
+
+static void crc32_update(union digest_state *st, const void *data, size_t len)
+{
+	st->crc = checksum_crc32(st->crc, data, len);
+}
+
+static void crc32_final(union digest_state *st, unsigned char *out)
+{
+	out[0] = st->crc >> 24;
+	out[1] = st->crc >> 16;
+	out[2] = st->crc >> 8;
+	out[3] = st->crc;
+}
+
+static void crc32c_update(union digest_state *st, const void *data, size_t len)
+{
+	st->crc = checksum_crc32c(st->crc, data, len);
+}
+
+static void xxh64_digest_init(union digest_state *st)
+{
+	xxh64_init(&st->xxh64, 0);
+}
+
+static void xxh64_digest_update(union digest_state *st, const void *data,
+		size_t len)
+{
+	xxh64_update(&st->xxh64, data, len);
+}
+
+/* Big-endian, like xxhsum prints it */
+static void xxh64_digest_final(union digest_state *st, unsigned char *out)
+{
+	uint64_t h = xxh64_final(&st->xxh64);
+	int i;
+
+	for (i = 0; i < 8; i++)
+		out[i] = h >> (56 - 8 * i);
+}
+
+#ifdef HAVE_SHA_NI
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* Compress nblocks 64-byte blocks with the SHA extensions. The round
+ * instructions want the state split as ABEF/CDGH rather than the
+ * natural ABCD/EFGH order, so shuffle on the way in and out. */
+__attribute__((target("sha,sse4.1")))
+static void sha256_ni_blocks(uint32_t h[8], const unsigned char *data,
+		size_t nblocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+			0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp;
+	__m128i w[16];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&h[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (nblocks--) {
+		abef = state0;
+		cdgh = state1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				msg = _mm_loadu_si128((const __m128i *)
+						(data + i * 16));
+				w[i] = _mm_shuffle_epi8(msg, bswap);
+			} else {
+				tmp = _mm_sha256msg1_epu32(w[i - 4], w[i - 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[i - 1],
+						w[i - 2], 4));
+				w[i] = _mm_sha256msg2_epu32(tmp, w[i - 1]);
+			}
+			msg = _mm_add_epi32(w[i], _mm_load_si128(
+					(const __m128i *)&sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		data += SHA256_CBLOCK;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *)&h[0], state0);
+	_mm_storeu_si128((__m128i *)&h[4], state1);
+}
+
+static void sha256_ni_init(union digest_state *st)
+{
+	struct sha256_state *s = &st->sha256_hw;
+
+	memcpy(s->h, sha256_iv, sizeof(s->h));
+	s->block_len = 0;
+	s->total = 0;
+}
+
+static void sha256_ni_update(union digest_state *st, const void *data,
+		size_t len)
+{
+	struct sha256_state *s = &st->sha256_hw;
+	const unsigned char *p = data;
+	size_t n;
+
+	s->total += len;
+
+	if (s->block_len) {
+		n = min(len, SHA256_CBLOCK - s->block_len);
+		memcpy(s->block + s->block_len, p, n);
+		s->block_len += n;
+		p += n;
+		len -= n;
+		if (s->block_len < SHA256_CBLOCK)
+			return;
+		sha256_ni_blocks(s->h, s->block, 1);
+		s->block_len = 0;
+	}
+
+	n = len / SHA256_CBLOCK;
+	if (n) {
+		sha256_ni_blocks(s->h, p, n);
+		p += n * SHA256_CBLOCK;
+		len -= n * SHA256_CBLOCK;
+	}
+
+	if (len) {
+		memcpy(s->block, p, len);
+		s->block_len = len;
+	}
+}
+
+static void sha256_ni_final(union digest_state *st, unsigned char *out)
+{
+	struct sha256_state *s = &st->sha256_hw;
+	uint64_t bits = s->total * 8;
+	int i;
+
+	s->block[s->block_len++] = 0x80;
+	if (s->block_len > SHA256_CBLOCK - 8) {
+		memset(s->block + s->block_len, 0,
+				SHA256_CBLOCK - s->block_len);
+		sha256_ni_blocks(s->h, s->block, 1);
+		s->block_len = 0;
+	}
+	memset(s->block + s->block_len, 0, SHA256_CBLOCK - 8 - s->block_len);
+	for (i = 0; i < 8; i++)
+		s->block[SHA256_CBLOCK - 1 - i] = bits >> (i * 8);
+	sha256_ni_blocks(s->h, s->block, 1);
+
+	for (i = 0; i < 8; i++) {
+		out[i * 4] = s->h[i] >> 24;
+		out[i * 4 + 1] = s->h[i] >> 16;
+		out[i * 4 + 2] = s->h[i] >> 8;
+		out[i * 4 + 3] = s->h[i];
+	}
+}
+
+static bool cpu_has_sha_ni(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (!(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+		return false;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & (1 << 29)) != 0;
+}
+
+static const struct digest_alg sha256_ni_alg = {
+	.name = "sha256",
+	.len = SHA256_DIGEST_LENGTH,
+	.init = sha256_ni_init,
+	.update = sha256_ni_update,
+	.final = sha256_ni_final,
+};
+
+#endif /* HAVE_SHA_NI */
+
+/* SHA-1 and the generic SHA-256 come from libcrypto, which does its own
+ * CPU feature detection on the architectures it has assembly for */
+static const struct digest_alg digest_algs[] = {
+	{
+		.name = "sha1",
+		.len = SHA_DIGEST_LENGTH,
+		.init = sha1_init,
+		.update = sha1_update,
+		.final = sha1_final,
+	},
+	{
+		.name = "sha256",
+		.len = SHA256_DIGEST_LENGTH,
+		.init = sha256_init,
+		.update = sha256_update,
+		.final = sha256_final,
+	},
+	{
+		.name = "crc32",
+		.len = 4,
+		.init = crc32_init,
+		.update = crc32_update,
+		.final = crc32_final,
+	},
+	{
+		.name = "crc32c",
+		.len = 4,
+		.init = crc32_init,
+		.update = crc32c_update,
+		.final = crc32_final,
+	},
+	{
+		.name = "xxh64",
+		.len = 8,
+		.init = xxh64_digest_init,
+		.update = xxh64_digest_update,
+		.final = xxh64_digest_final,
+	},
+};
+
+static pthread_once_t digest_once = PTHREAD_ONCE_INIT;
+static const struct digest_alg *sha256_impl = &digest_algs[1];
+
+static void digest_setup(void)
+{
+#ifdef HAVE_SHA_NI
+	if (cpu_has_sha_ni()) {
+		pr_debug("Using SHA extensions for SHA-256\n");
+		sha256_impl = &sha256_ni_alg;
+	}
+#endif
+}
+
+const struct digest_alg *digest_alg_by_name(const char *name)
+{
+	unsigned int i;
+
+	pthread_once(&digest_once, digest_setup);
+
+	for (i = 0; i < sizeof(digest_algs) / sizeof(digest_algs[0]); i++) {
+		if (strcmp(digest_algs[i].name, name))
+			continue;
+		if (&digest_algs[i] == &digest_algs[1])
+			return sha256_impl;
+		return &digest_algs[i];
+	}
+	return NULL;
+}
+
+const struct digest_alg *digest_alg_default(void)
+{
+	return digest_alg_by_name("sha1");
+}
+
+void digest_init(struct digest_ctx *ctx, const struct digest_alg *alg)
+{
+	ctx->alg = alg;
+	alg->init(&ctx->st);
+}
+
+void digest_update(struct digest_ctx *ctx, const void *data, size_t len)
+{
+	ctx->alg->update(&ctx->st, data, len);
+}
+
+void digest_final(struct digest_ctx *ctx, unsigned char *out)
+{
+	ctx->alg->final(&ctx->st, out);
+}
+
+char *digest_to_string(const struct digest_alg *alg, const unsigned char *digest)
+{
+	char *str;
+	size_t i;
+
+	str = xmalloc(alg->len * 2 + 1);
+	for (i = 0; i < alg->len; i++)
+		snprintf(str + i * 2, 3, "%02x", digest[i]);
+	return str;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
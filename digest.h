@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_DIGEST_H_
+#define _USERFASTBOOT_DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+#include <gpt/checksum.h>
+
+#define DIGEST_MAX_LENGTH	SHA256_DIGEST_LENGTH
+
+struct sha256_state {
+	uint32_t h[8];
+	unsigned char block[SHA256_CBLOCK];
+	size_t block_len;
+	uint64_t total;
+};
+
+union digest_state {
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+	struct sha256_state sha256_hw;
+	struct xxh64_state xxh64;
+	uint32_t crc;
+};
+
+struct digest_alg {
+	const char *name;
+	size_t len;
+	void (*init)(union digest_state *st);
+	void (*update)(union digest_state *st, const void *data, size_t len);
+	void (*final)(union digest_state *st, unsigned char *out);
+};
+
+struct digest_ctx {
+	const struct digest_alg *alg;
+	union digest_state st;
+};
+
+/* Look up an algorithm by name ("sha1", "sha256", "crc32", "crc32c",
+ * "xxh64"). Where the CPU has instructions for an algorithm, the
+ * accelerated implementation is returned. NULL if unknown. */
+const struct digest_alg *digest_alg_by_name(const char *name);
+
+/* The algorithm used when the caller doesn't specify one */
+const struct digest_alg *digest_alg_default(void);
+
+void digest_init(struct digest_ctx *ctx, const struct digest_alg *alg);
+void digest_update(struct digest_ctx *ctx, const void *data, size_t len);
+void digest_final(struct digest_ctx *ctx, unsigned char *out);
+
+/* Hex representation of a digest; must be freed */
+char *digest_to_string(const struct digest_alg *alg, const unsigned char *digest);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "efivar_cache.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+/* Only a handful of variables are ever read, so a list will do */
+struct efi_cache_entry {
+	efi_guid_t guid;
+	char *name;
+	bool present;
+	uint8_t *data;
+	size_t size;
+	uint32_t attributes;
+	struct efi_cache_entry *next;
+};
+
+static struct efi_cache_entry *efi_cache;
+static pthread_mutex_t efi_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct efi_cache_entry *find_entry(efi_guid_t guid, const char *name)
+{
+	struct efi_cache_entry *e;
+
+	for (e = efi_cache; e; e = e->next) {
+		if (!memcmp(&e->guid, &guid, sizeof(guid)) &&
+				!strcmp(e->name, name))
+			return e;
+	}
+	return NULL;
+}
+
+static void drop_entry(efi_guid_t guid, const char *name)
+{
+	struct efi_cache_entry **pos, *e;
+
+	for (pos = &efi_cache; (e = *pos); pos = &e->next) {
+		if (memcmp(&e->guid, &guid, sizeof(guid)) ||
+				strcmp(e->name, name))
+			continue;
+		*pos = e->next;
+		free(e->name);
+		free(e->data);
+		free(e);
+		return;
+	}
+}
+
+/* Record the current value of a variable; data NULL means it doesn't
+ * exist */
+static void store_entry(efi_guid_t guid, const char *name,
+		const uint8_t *data, size_t size, uint32_t attributes)
+{
+	struct efi_cache_entry *e;
+
+	e = find_entry(guid, name);
+	if (!e) {
+		e = xmalloc(sizeof(*e));
+		memset(e, 0, sizeof(*e));
+		e->guid = guid;
+		e->name = xstrdup(name);
+		e->next = efi_cache;
+		efi_cache = e;
+	}
+
+	free(e->data);
+	e->data = NULL;
+	e->present = data != NULL;
+	e->size = size;
+	e->attributes = attributes;
+	if (data) {
+		e->data = xmalloc(size + 1);
+		memcpy(e->data, data, size);
+	}
+}
+
+int efi_cache_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
+		size_t *data_size, uint32_t *attributes)
+{
+	struct efi_cache_entry *e;
+	int ret;
+
+	pthread_mutex_lock(&efi_cache_lock);
+
+	e = find_entry(guid, name);
+	if (!e) {
+		ret = efi_get_variable(guid, name, data, data_size,
+				attributes);
+		if (!ret) {
+			store_entry(guid, name, *data, *data_size,
+					*attributes);
+		} else if (errno == ENOENT) {
+			store_entry(guid, name, NULL, 0, 0);
+			errno = ENOENT;
+		}
+		/* Other errors aren't cached, the next read retries */
+		goto out;
+	}
+
+	if (!e->present) {
+		errno = ENOENT;
+		ret = -1;
+		goto out;
+	}
+
+	*data = xmalloc(e->size + 1);
+	memcpy(*data, e->data, e->size);
+	*data_size = e->size;
+	*attributes = e->attributes;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&efi_cache_lock);
+	return ret;
+}
+
+int efi_cache_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
+		size_t data_size, uint32_t attributes)
+{
+	int ret;
+
+	pthread_mutex_lock(&efi_cache_lock);
+
+	ret = efi_set_variable(guid, name, data, data_size, attributes);
+	if (ret || (attributes & (EFI_VARIABLE_APPEND_WRITE |
+				EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS |
+				EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS))) {
+		/* Unknown or not worth working out, read it back next time.
+		 * Authenticated writes, deletes included, pass a signed
+		 * descriptor ahead of the payload, not the new value. */
+		drop_entry(guid, name);
+	} else if (!data_size) {
+		/* Writing nothing deletes the variable */
+		store_entry(guid, name, NULL, 0, 0);
+	} else {
+		store_entry(guid, name, data, data_size, attributes);
+	}
+
+	pthread_mutex_unlock(&efi_cache_lock);
+	return ret;
+}
+
+void efi_cache_invalidate(void)
+{
+	struct efi_cache_entry *e;
+
+	pthread_mutex_lock(&efi_cache_lock);
+	while ((e = efi_cache)) {
+		efi_cache = e->next;
+		free(e->name);
+		free(e->data);
+		free(e);
+	}
+	pthread_mutex_unlock(&efi_cache_lock);
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
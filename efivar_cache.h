@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_EFIVAR_CACHE_H_
+#define _USERFASTBOOT_EFIVAR_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <efivar.h>
+
+/* Drop-in replacements for efi_get_variable() and efi_set_variable()
+ * for the variables we consult on every command. The first read of a
+ * variable goes to the firmware, later ones are served from memory,
+ * including "doesn't exist". Writes go to the firmware and then update
+ * the cache. *data from efi_cache_get_variable() must be freed. */
+int efi_cache_get_variable(efi_guid_t guid, const char *name, uint8_t **data,
+		size_t *data_size, uint32_t *attributes);
+int efi_cache_set_variable(efi_guid_t guid, const char *name, uint8_t *data,
+		size_t data_size, uint32_t attributes);
+
+/* Forget everything, for when variables may have changed behind our
+ * back, e.g. after writing secure boot keys */
+void efi_cache_invalidate(void);
+
+#endif
@@ -45,11 +45,14 @@
 #include <inttypes.h>
 
 #include <cutils/hashmap.h>
+#include <openssl/evp.h>
 
 #include "userfastboot.h"
 #include "userfastboot_ui.h"
 #include "fastboot.h"
 #include "userfastboot_util.h"
+#include "digest.h"
+#include "xfer_stats.h"
 
 
 #define USB_ADB_PATH      "/dev/android_adb"
@@ -194,29 +197,166 @@ void fastboot_register(const char *prefix,
 
 static Hashmap *vars;
 
+/* Variables whose value is computed when queried. Entries are never
+ * freed, so pointers to them stay valid; fn is NULL once the variable
+ * has been taken over by fastboot_publish(). Protected by the vars
+ * lock, each getter's fields by its own lock. */
+struct var_getter {
+	pthread_mutex_t lock;
+	fastboot_getter fn;
+	void *ctx;
+	unsigned int ttl_ms;
+	char *value;
+	int64_t expires;
+	unsigned int gen;	/* bumped whenever the fields above change */
+};
+
+static Hashmap *getters;
+
+/* Bumped whenever a variable is added or changes value */
+static unsigned int vars_generation = 1;
+
+static bool getter_active(struct var_getter *g)
+{
+	bool ret;
+
+	pthread_mutex_lock(&g->lock);
+	ret = g->fn != NULL;
+	pthread_mutex_unlock(&g->lock);
+	return ret;
+}
+
 void fastboot_publish(char *name, char *value)
 {
+	struct var_getter *g;
+	char *old;
+
 	pr_verbose("publishing %s=%s\n", name, value);
 
 	hashmapLock(vars);
 
-	if (hashmapContainsKey(vars, name)) {
+	g = hashmapGet(getters, name);
+	if (g) {
+		pthread_mutex_lock(&g->lock);
+		if (g->fn) {
+			pr_verbose("replacing getter\n");
+			g->fn = NULL;
+			free(g->value);
+			g->value = NULL;
+			g->gen++;
+			__atomic_add_fetch(&vars_generation, 1,
+					__ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&g->lock);
+	}
+
+	old = hashmapGet(vars, name);
+	if (old && !strcmp(old, value)) {
+		pr_verbose("value unchanged\n");
+		free(value);
+	} else if (old) {
 		pr_verbose("replacing old value\n");
 		free(hashmapPut(vars, name, value));
+		__atomic_add_fetch(&vars_generation, 1, __ATOMIC_RELEASE);
 	} else {
 		pr_verbose("new value for table\n");
 		hashmapPut(vars, xstrdup(name), value);
+		__atomic_add_fetch(&vars_generation, 1, __ATOMIC_RELEASE);
+	}
+
+	hashmapUnlock(vars);
+}
+
+void fastboot_publish_getter(char *name, fastboot_getter fn, void *ctx,
+		unsigned int ttl_ms)
+{
+	struct var_getter *g;
+
+	pr_verbose("publishing getter for %s, ttl %u ms\n", name, ttl_ms);
+
+	hashmapLock(vars);
+
+	g = hashmapGet(getters, name);
+	if (!g) {
+		g = xmalloc(sizeof(*g));
+		memset(g, 0, sizeof(*g));
+		pthread_mutex_init(&g->lock, NULL);
+		hashmapPut(getters, xstrdup(name), g);
 	}
 
+	pthread_mutex_lock(&g->lock);
+	if (g->fn != fn || g->ctx != ctx || g->ttl_ms != ttl_ms) {
+		g->fn = fn;
+		g->ctx = ctx;
+		g->ttl_ms = ttl_ms;
+		free(g->value);
+		g->value = NULL;
+		g->gen++;
+		__atomic_add_fetch(&vars_generation, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&g->lock);
+
 	hashmapUnlock(vars);
 }
 
+/* Copy of the current value of a getter, computed again unless the
+ * cached one is still within its TTL. The cached value may be replaced
+ * as soon as g->lock is dropped, so callers get their own copy and must
+ * free it. NULL if it has been replaced or failed.
+ *
+ * fn runs without g->lock held, since getters take locks of their own
+ * and may be slow. If the getter changed or another caller refreshed it
+ * meanwhile, the value we computed is returned but not cached. */
+static char *run_getter(const char *name, struct var_getter *g)
+{
+	fastboot_getter fn;
+	void *ctx;
+	unsigned int gen;
+	char *value;
+
+	pthread_mutex_lock(&g->lock);
+	if (!g->fn || (g->value && g->ttl_ms && now_ms() < g->expires)) {
+		value = g->fn && g->value ? xstrdup(g->value) : NULL;
+		pthread_mutex_unlock(&g->lock);
+		return value;
+	}
+	fn = g->fn;
+	ctx = g->ctx;
+	gen = g->gen;
+	pthread_mutex_unlock(&g->lock);
+
+	value = fn(name, ctx);
+
+	pthread_mutex_lock(&g->lock);
+	if (g->gen == gen) {
+		free(g->value);
+		g->value = value;
+		g->expires = now_ms() + g->ttl_ms;
+		g->gen++;
+		value = value ? xstrdup(value) : NULL;
+	} else if (!g->fn) {
+		free(value);
+		value = NULL;
+	}
+	pthread_mutex_unlock(&g->lock);
+
+	return value;
+}
+
 char *fastboot_getvar(char *name)
 {
+	struct var_getter *g;
 	char *ret;
 
 	hashmapLock(vars);
+	g = hashmapGet(getters, name);
+	if (g && getter_active(g)) {
+		hashmapUnlock(vars);
+		return run_getter(name, g);
+	}
+	/* fastboot_publish() frees the old value when it changes */
 	ret = hashmapGet(vars, name);
+	ret = ret ? xstrdup(ret) : NULL;
 	hashmapUnlock(vars);
 
 	return ret;
@@ -235,6 +375,18 @@ static pid_t fastboot_pid;
 
 static unsigned fastboot_state = STATE_OFFLINE;
 
+/* Output staged for the host to fetch with the "upload" command. With
+ * staging enabled, fastboot_report() lines accumulate here instead of
+ * each costing a round trip as an INFO packet. */
+static char *stage_buf;
+static size_t stage_len;
+static size_t stage_alloc;
+static bool stage_enabled;
+static bool stage_started;	/* current command has staged output */
+
+/* Room for an INFO payload in a MAGIC_LENGTH response */
+#define MAX_INFO_LEN	59
+
 static int usb_read(void *_buf, unsigned len)
 {
 	int r = 0;
@@ -305,37 +457,156 @@ oops:
 	return -1;
 }
 
+/* Downloads are digested on a helper thread while the next buffer is
+ * being received, so getting the digests costs no extra pass over the
+ * data */
+#define XFER_BUFFERS	2
+
+struct xfer_digest {
+	unsigned char *buf[XFER_BUFFERS];
+	unsigned int filled[XFER_BUFFERS];
+	int head;	/* next buffer to receive into */
+	int tail;	/* next buffer to digest */
+	int queued;
+	bool done;
+	struct digest_ctx crc32c;
+	struct digest_ctx sha256;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *xfer_digest_thread(void *data)
+{
+	struct xfer_digest *xd = data;
+
+	for (;;) {
+		int slot;
+
+		pthread_mutex_lock(&xd->lock);
+		while (!xd->queued && !xd->done)
+			pthread_cond_wait(&xd->cond, &xd->lock);
+		if (!xd->queued) {
+			pthread_mutex_unlock(&xd->lock);
+			break;
+		}
+		slot = xd->tail;
+		pthread_mutex_unlock(&xd->lock);
+
+		digest_update(&xd->crc32c, xd->buf[slot], xd->filled[slot]);
+		digest_update(&xd->sha256, xd->buf[slot], xd->filled[slot]);
+
+		pthread_mutex_lock(&xd->lock);
+		xd->tail = (slot + 1) % XFER_BUFFERS;
+		xd->queued--;
+		pthread_cond_broadcast(&xd->cond);
+		pthread_mutex_unlock(&xd->lock);
+	}
+	return NULL;
+}
+
+/* The value has to fit in an OKAY response, so the SHA-256 is base64
+ * rather than hex: "<crc32c hex> <sha256 base64>" */
+static void publish_download_digest(struct xfer_digest *xd)
+{
+	unsigned char crc[4];
+	unsigned char sha[SHA256_DIGEST_LENGTH];
+	unsigned char sha64[((SHA256_DIGEST_LENGTH + 2) / 3) * 4 + 1];
+	char *crcstr, *shastr;
+
+	digest_final(&xd->crc32c, crc);
+	digest_final(&xd->sha256, sha);
+	EVP_EncodeBlock(sha64, sha, sizeof(sha));
+
+	crcstr = digest_to_string(xd->crc32c.alg, crc);
+	shastr = digest_to_string(xd->sha256.alg, sha);
+	pr_debug("download crc32c %s sha256 %s\n", crcstr, shastr);
+	fastboot_publish("download-digest", xasprintf("%s %s", crcstr, sha64));
+	free(crcstr);
+	free(shastr);
+}
+
 static int usb_read_to_file(int fd, unsigned int len)
 {
-	char buf[XFER_MEM_SIZE];
+	struct xfer_digest xd;
+	pthread_t digest_thread;
 	int r = 0;
 	int count = 0;
+	int i;
 	unsigned int orig_len = len;
 
+	/* Don't leave the previous download's digest around */
+	fastboot_publish("download-digest", xstrdup(""));
+
+	memset(&xd, 0, sizeof(xd));
+	for (i = 0; i < XFER_BUFFERS; i++)
+		xd.buf[i] = xmalloc(XFER_MEM_SIZE);
+	pthread_mutex_init(&xd.lock, NULL);
+	pthread_cond_init(&xd.cond, NULL);
+	digest_init(&xd.crc32c, digest_alg_by_name("crc32c"));
+	digest_init(&xd.sha256, digest_alg_by_name("sha256"));
+
+	if (pthread_create(&digest_thread, NULL, xfer_digest_thread, &xd)) {
+		pr_perror("pthread_create");
+		count = -1;
+		goto out_free;
+	}
+
 	lseek64(fd, 0, SEEK_SET);
 
 	mui_show_progress(1.0, 0);
+	xfer_start(XFER_DOWNLOAD, orig_len);
 	while (len > 0)
 	{
 		unsigned int size = (len > XFER_MEM_SIZE) ? XFER_MEM_SIZE : len;
-		r = usb_read(buf, size);
+		int slot;
+
+		pthread_mutex_lock(&xd.lock);
+		while (xd.queued == XFER_BUFFERS)
+			pthread_cond_wait(&xd.cond, &xd.lock);
+		slot = xd.head;
+		pthread_mutex_unlock(&xd.lock);
+
+		r = usb_read(xd.buf[slot], size);
 		if ((r < 0) || ((unsigned int)r != size)) {
 			pr_error("fastboot: usb_read_to_file error only got %d bytes\n", r);
 			count = -1;
 			goto out;
 		}
-		r = write(fd, buf, size);
+		r = write(fd, xd.buf[slot], size);
 		if ((r < 0) || ((unsigned int)r != size)) {
 			pr_perror("write");
 			count = -1;
 			goto out;
 		}
+
+		pthread_mutex_lock(&xd.lock);
+		xd.filled[slot] = size;
+		xd.head = (slot + 1) % XFER_BUFFERS;
+		xd.queued++;
+		pthread_cond_broadcast(&xd.cond);
+		pthread_mutex_unlock(&xd.lock);
+
 		len -= size;
 		count += size;
 		mui_set_progress((float)count / (float)orig_len);
+		xfer_add(XFER_DOWNLOAD, size, 0);
 	}
 out:
+	pthread_mutex_lock(&xd.lock);
+	xd.done = true;
+	pthread_cond_broadcast(&xd.cond);
+	pthread_mutex_unlock(&xd.lock);
+	pthread_join(digest_thread, NULL);
+
+	if (count >= 0)
+		publish_download_digest(&xd);
+	xfer_finish(XFER_DOWNLOAD);
 	mui_reset_progress();
+out_free:
+	for (i = 0; i < XFER_BUFFERS; i++)
+		free(xd.buf[i]);
+	pthread_cond_destroy(&xd.cond);
+	pthread_mutex_destroy(&xd.lock);
 	return count;
 }
 
@@ -371,10 +642,80 @@ void fastboot_info(const char *fmt, ...)
 	va_end(ap);
 }
 
+static void stage_reset(void)
+{
+	free(stage_buf);
+	stage_buf = NULL;
+	stage_len = stage_alloc = 0;
+}
+
+static void stage_append(const char *data, size_t len)
+{
+	if (stage_len + len > stage_alloc) {
+		stage_alloc = max(stage_alloc * 2, stage_len + len);
+		stage_buf = xrealloc(stage_buf, stage_alloc);
+	}
+	memcpy(stage_buf + stage_len, data, len);
+	stage_len += len;
+}
+
+void fastboot_set_staging(bool enable)
+{
+	stage_enabled = enable;
+	if (!enable)
+		stage_reset();
+}
+
+void fastboot_report(const char *fmt, ...)
+{
+	va_list ap;
+	char *line;
+	char *pos;
+	int len;
+
+	if (gettid() != fastboot_pid || fastboot_state != STATE_COMMAND)
+		return;
+
+	va_start(ap, fmt);
+	len = vasprintf(&line, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+
+	if (stage_enabled) {
+		/* Each command's output replaces whatever was left over
+		 * from the previous one */
+		if (!stage_started) {
+			stage_reset();
+			stage_started = true;
+		}
+		stage_append(line, len);
+		stage_append("\n", 1);
+	} else {
+		for (pos = line; len > MAX_INFO_LEN; pos += MAX_INFO_LEN) {
+			fastboot_info("%.*s", MAX_INFO_LEN, pos);
+			len -= MAX_INFO_LEN;
+		}
+		fastboot_info("%s", pos);
+	}
+	free(line);
+}
+
+/* Let the host know there's something to fetch before we finish */
+static void stage_notify(void)
+{
+	if (!stage_started)
+		return;
+	stage_started = false;
+	fastboot_info("%zu bytes staged, use 'fastboot get_staged'",
+			stage_len);
+}
+
 void fastboot_fail(const char *fmt, ...)
 {
 	va_list ap;
 
+	stage_notify();
 	va_start(ap, fmt);
 	fastboot_ack("FAIL", fmt, ap);
 	va_end(ap);
@@ -386,6 +727,7 @@ void fastboot_okay(const char *fmt, ...)
 {
 	va_list ap;
 
+	stage_notify();
 	va_start(ap, fmt);
 	fastboot_ack("OKAY", fmt, ap);
 	va_end(ap);
@@ -393,52 +735,159 @@ void fastboot_okay(const char *fmt, ...)
 	fastboot_state = STATE_COMPLETE;
 }
 
-struct getvar_ctx {
-	char **entries;
-	int i;
+/* Sorted list of variables for getvar all, built from the tables as of
+ * some generation and never modified afterwards. Only the fastboot
+ * thread uses it, so it can be read without taking the vars lock.
+ * Published values are formatted up front; getters are run as the list
+ * is sent. */
+struct snapshot_var {
+	const char *name;
+	char *line;
+	struct var_getter *getter;
 };
 
-/* from the qsort man page */
-static int cmpstringp(const void *p1, const void *p2)
+struct vars_snapshot {
+	unsigned int generation;
+	int count;
+	struct snapshot_var *entries;
+};
+
+static struct vars_snapshot *vars_snapshot;
+
+static int cmp_snapshot_var(const void *p1, const void *p2)
 {
-	return strcmp(* (char * const *) p1, * (char * const *) p2);
+	const struct snapshot_var *v1 = p1;
+	const struct snapshot_var *v2 = p2;
+
+	return strcmp(v1->name, v2->name);
 }
 
-static bool getvar_all_cb(void *key, void *value, void *context)
+static bool snapshot_var_cb(void *key, void *value, void *context)
 {
-	char *keystr = key;
-	char *valstr = value;
-	struct getvar_ctx *ctx = context;
+	struct vars_snapshot *snap = context;
+	struct snapshot_var *v = &snap->entries[snap->count];
+	struct var_getter *g;
+
+	/* Shadowed by a getter, which gets its own entry */
+	g = hashmapGet(getters, key);
+	if (g && getter_active(g))
+		return true;
+
+	v->name = key;
+	v->line = xasprintf("%s: %s", (char *)key, (char *)value);
+	v->getter = NULL;
+	snap->count++;
+	return true;
+}
+
+static bool snapshot_getter_cb(void *key, void *value, void *context)
+{
+	struct vars_snapshot *snap = context;
+	struct snapshot_var *v = &snap->entries[snap->count];
+
+	if (!getter_active(value))
+		return true;
 
-	ctx->entries[ctx->i++] = xasprintf("%s: %s", keystr, valstr);
+	v->name = key;
+	v->line = NULL;
+	v->getter = value;
+	snap->count++;
 	return true;
 }
 
-static void cmd_getvar(char *arg, int fd, void *data, unsigned sz)
+static void free_vars_snapshot(struct vars_snapshot *snap)
 {
-	const char *value;
+	int i;
 
-	pr_debug("fastboot: cmd_getvar %s\n", arg);
-	if (!strcmp(arg, "all")) {
-		struct getvar_ctx ctx;
-		int mapsize;
-		int i;
+	if (!snap)
+		return;
+	for (i = 0; i < snap->count; i++)
+		free(snap->entries[i].line);
+	free(snap->entries);
+	free(snap);
+}
 
-		hashmapLock(vars);
-		mapsize = hashmapSize(vars);
+/* Return the current snapshot, rebuilding it only if something has been
+ * published since it was taken */
+static struct vars_snapshot *get_vars_snapshot(void)
+{
+	struct vars_snapshot *snap;
+	size_t max;
 
-		ctx.entries = calloc(mapsize, sizeof(char *));
-		ctx.i = 0;
+	if (vars_snapshot && vars_snapshot->generation ==
+			__atomic_load_n(&vars_generation, __ATOMIC_ACQUIRE))
+		return vars_snapshot;
 
-		hashmapForEach(vars, getvar_all_cb, &ctx);
-		hashmapUnlock(vars);
+	snap = xmalloc(sizeof(*snap));
+	hashmapLock(vars);
+	snap->generation = vars_generation;
+	snap->count = 0;
+	max = hashmapSize(vars) + hashmapSize(getters);
+	snap->entries = xmalloc(max * sizeof(*snap->entries) + 1);
+	hashmapForEach(vars, snapshot_var_cb, snap);
+	hashmapForEach(getters, snapshot_getter_cb, snap);
+	hashmapUnlock(vars);
+
+	qsort(snap->entries, snap->count, sizeof(*snap->entries),
+			cmp_snapshot_var);
+
+	pr_debug("rebuilt getvar snapshot, generation %u, %d vars\n",
+			snap->generation, snap->count);
+	free_vars_snapshot(vars_snapshot);
+	vars_snapshot = snap;
+	return snap;
+}
+
+/* Report every variable whose name starts with prefix, in order */
+static void report_vars(const char *prefix)
+{
+	struct vars_snapshot *snap = get_vars_snapshot();
+	size_t len = strlen(prefix);
+	char *value;
+	int i;
+
+	for (i = 0; i < snap->count; i++) {
+		struct snapshot_var *v = &snap->entries[i];
 
-		qsort(ctx.entries, mapsize, sizeof(char *), cmpstringp);
-		for (i = 0; i < mapsize; i++) {
-			fastboot_info("%s", ctx.entries[i]);
-			free(ctx.entries[i]);
+		if (strncmp(v->name, prefix, len))
+			continue;
+		if (!v->getter) {
+			fastboot_report("%s", v->line);
+			continue;
+		}
+		value = run_getter(v->name, v->getter);
+		if (value)
+			fastboot_report("%s: %s", v->name, value);
+		free(value);
+	}
+}
+
+/* getvar:all, getvar:<name>, or a comma-separated list of names and
+ * prefix* wildcards answered with one INFO line each, so the host can
+ * fetch several in one round trip */
+static void cmd_getvar(char *arg, int fd, void *data, unsigned sz)
+{
+	char *value;
+	char *key, *saveptr;
+	size_t len;
+
+	pr_debug("fastboot: cmd_getvar %s\n", arg);
+	if (!strcmp(arg, "all")) {
+		report_vars("");
+		fastboot_okay("");
+	} else if (strchr(arg, ',') || strchr(arg, '*')) {
+		for (key = strtok_r(arg, ",", &saveptr); key;
+				key = strtok_r(NULL, ",", &saveptr)) {
+			len = strlen(key);
+			if (len && key[len - 1] == '*') {
+				key[len - 1] = '\0';
+				report_vars(key);
+				continue;
+			}
+			value = fastboot_getvar(key);
+			fastboot_report("%s: %s", key, value ? value : "");
+			free(value);
 		}
-		free(ctx.entries);
 		fastboot_okay("");
 	} else {
 		value = fastboot_getvar(arg);
@@ -447,6 +896,7 @@ static void cmd_getvar(char *arg, int fd, void *data, unsigned sz)
 		} else {
 			fastboot_okay("");
 		}
+		free(value);
 	}
 }
 
@@ -482,6 +932,27 @@ static void cmd_download(char *arg, int fd, void *data, unsigned sz)
 	fastboot_okay("");
 }
 
+static void cmd_upload(char *arg, int fd, void *data, unsigned sz)
+{
+	char response[MAGIC_LENGTH];
+
+	if (!stage_len) {
+		fastboot_fail("nothing staged");
+		return;
+	}
+
+	pr_debug("fastboot: cmd_upload %zu bytes\n", stage_len);
+	snprintf(response, sizeof(response), "DATA%08zx", stage_len);
+	if (usb_write(response, strlen(response)) < 0)
+		return;
+
+	if (usb_write(stage_buf, stage_len) < 0)
+		return;
+
+	stage_reset();
+	fastboot_okay("");
+}
+
 static void fastboot_command_loop(void)
 {
 	struct fastboot_cmd *cmd;
@@ -504,6 +975,7 @@ again:
 			if (memcmp(buffer, cmd->prefix, cmd->prefix_len))
 				continue;
 			fastboot_state = STATE_COMMAND;
+			stage_started = false;
 
 			fd = open(FASTBOOT_DOWNLOAD_TMP_FILE, O_RDWR | O_CREAT, 0600);
 			if (fd < 0) {
@@ -720,6 +1192,8 @@ static int open_usb(void)
  * */
 void close_iofds(void)
 {
+	/* Usually we're about to reboot, get the log out first */
+	logger_flush();
 	if (io.write_fp >= 0) {
 		close(io.write_fp);
 		io.write_fp = -1;
@@ -800,8 +1274,10 @@ int fastboot_init(unsigned long size)
 	pr_verbose("fastboot_init()\n");
 	download_max = size;
 	vars = hashmapCreate(128, str_hash, str_equals);
+	getters = hashmapCreate(128, str_hash, str_equals);
 	fastboot_register("getvar:", cmd_getvar);
 	fastboot_register("download:", cmd_download);
+	fastboot_register("upload", cmd_upload);
 	fastboot_publish("max-download-size", xasprintf("0x%lX", download_max));
 	fastboot_pid = gettid();
 
@@ -28,6 +28,9 @@
 
 #ifndef __APP_FASTBOOT_H
 #define __APP_FASTBOOT_H
+
+#include <stdbool.h>
+
 #define FASTBOOT_DOWNLOAD_TMP_FILE "/tmp/fstboot.img"
 
 /* Initialize fastboot protocol */
@@ -44,7 +47,8 @@ int fastboot_handler(void);
 void fastboot_register(const char *prefix,
                        void (*handle)(char *arg, int fd, void *data, unsigned size));
 
-/* Fetch the value of a fastboot_publish variable */
+/* Fetch a copy of the value of a fastboot_publish variable, which
+ * the caller must free; NULL if there is none */
 char *fastboot_getvar(char *name);
 
 /* only callable from within a command handler */
@@ -52,12 +56,31 @@ void fastboot_info(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)))
 void fastboot_fail(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void fastboot_okay(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 
+/* Command output for the user, one line per call. Sent as INFO packets,
+ * split as needed, unless staging is enabled, in which case it is
+ * buffered for the host to fetch with "fastboot get_staged". Only
+ * callable from within a command handler. */
+void fastboot_report(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+
+/* Turn staging of fastboot_report() output on or off */
+void fastboot_set_staging(bool enable);
+
 /* Takes ownership of the value pointer, may be freed at any time. Do not
  * use a constant string! xstrdup() is your friend.
  * It uses a copy of the name pointer, can be a constant string or something
  * on the heap; free it after publishing if you need to */
 void fastboot_publish(char *name, char *value);
 
+/* Computes the value of a variable when it is queried. Returns a heap
+ * string, which fastboot takes ownership of, or NULL on failure. */
+typedef char *(*fastboot_getter)(const char *name, void *ctx);
+
+/* Have fn supply the value of name. The result is reused for ttl_ms, or
+ * recomputed on every query if ttl_ms is 0. Overrides any published value
+ * until the next fastboot_publish() of the same name. */
+void fastboot_publish_getter(char *name, fastboot_getter fn, void *ctx,
+		unsigned int ttl_ms);
+
 /**
  * Force to close file descriptor used at open_usb()
  * */
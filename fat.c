@@ -0,0 +1,515 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "fat.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+#define FAT_DIRENT_SIZE		32
+#define FAT_ATTR_VOLUME_ID	0x08
+#define FAT_ATTR_DIRECTORY	0x10
+#define FAT_ATTR_LFN		0x0f
+#define FAT_LCASE_BASE		0x08
+#define FAT_LCASE_EXT		0x10
+#define FAT_LFN_CHARS		13
+#define FAT_LFN_MAX_ENTRIES	20
+#define FAT_MAX_DEPTH		16
+#define FAT_MAX_DIR_SIZE	(65536 * FAT_DIRENT_SIZE)
+#define FAT_READ_MAX		(1024 * 1024)
+
+struct fat_volume {
+	int fd;
+	int bits;		/* 12, 16 or 32 */
+	uint32_t cluster_size;
+	uint32_t clusters;	/* number of data clusters */
+	uint64_t data_offset;	/* byte offset of cluster 2 */
+	uint64_t root_offset;	/* FAT12/16 fixed root directory */
+	uint32_t root_size;
+	uint32_t root_cluster;	/* FAT32 root directory */
+	unsigned char *fat;
+	size_t fat_size;
+};
+
+struct lfn_state {
+	uint16_t name[FAT_LFN_MAX_ENTRIES * FAT_LFN_CHARS];
+	int len;
+	int expect;		/* ordinal of the next LFN entry */
+	unsigned char checksum;
+	bool valid;
+};
+
+struct file_list {
+	struct fat_file *files;
+	size_t count;
+	size_t alloc;
+};
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool valid_cluster(struct fat_volume *fv, uint32_t c)
+{
+	return c >= 2 && c < fv->clusters + 2;
+}
+
+/* Next cluster in the chain, or 0 at the end of the chain or if the
+ * entry is bad */
+static uint32_t fat_next(struct fat_volume *fv, uint32_t c)
+{
+	uint32_t next;
+
+	switch (fv->bits) {
+	case 12:
+		next = get_le16(fv->fat + c + c / 2);
+		next = (c & 1) ? next >> 4 : next & 0xfff;
+		if (next >= 0xff7)
+			return 0;
+		break;
+	case 16:
+		next = get_le16(fv->fat + c * 2);
+		if (next >= 0xfff7)
+			return 0;
+		break;
+	default:
+		next = get_le32(fv->fat + c * 4) & 0x0fffffff;
+		if (next >= 0x0ffffff7)
+			return 0;
+		break;
+	}
+	return valid_cluster(fv, next) ? next : 0;
+}
+
+static uint64_t cluster_offset(struct fat_volume *fv, uint32_t c)
+{
+	return fv->data_offset + (uint64_t)(c - 2) * fv->cluster_size;
+}
+
+struct fat_volume *fat_open(int fd)
+{
+	unsigned char bs[512];
+	struct fat_volume *fv;
+	uint32_t bps, spc, reserved, nfats, root_entries;
+	uint64_t total, fat_sectors, root_sectors, data_sector;
+	uint64_t dev_size, needed;
+	off64_t end;
+
+	if (pread_full(fd, bs, sizeof(bs), 0))
+		return NULL;
+
+	if (bs[510] != 0x55 || bs[511] != 0xaa)
+		return NULL;
+
+	bps = get_le16(bs + 11);
+	spc = bs[13];
+	reserved = get_le16(bs + 14);
+	nfats = bs[16];
+	root_entries = get_le16(bs + 17);
+	total = get_le16(bs + 19);
+	if (!total)
+		total = get_le32(bs + 32);
+	fat_sectors = get_le16(bs + 22);
+	if (!fat_sectors)
+		fat_sectors = get_le32(bs + 36);
+
+	if ((bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) ||
+			!spc || (spc & (spc - 1)) || !reserved || !nfats ||
+			!fat_sectors)
+		return NULL;
+
+	/* Don't trust sizes in the boot sector that the device can't hold */
+	end = lseek64(fd, 0, SEEK_END);
+	if (end < 0) {
+		pr_perror("lseek64");
+		return NULL;
+	}
+	dev_size = end;
+	if (total * bps > dev_size) {
+		pr_debug("FAT claims %" PRIu64 " sectors, device is smaller\n",
+				total);
+		return NULL;
+	}
+
+	root_sectors = ((uint64_t)root_entries * FAT_DIRENT_SIZE + bps - 1) / bps;
+	data_sector = reserved + nfats * fat_sectors + root_sectors;
+	if (data_sector >= total)
+		return NULL;
+
+	fv = xmalloc(sizeof(*fv));
+	memset(fv, 0, sizeof(*fv));
+	fv->fd = fd;
+	fv->cluster_size = bps * spc;
+	fv->clusters = (total - data_sector) / spc;
+	fv->data_offset = data_sector * bps;
+
+	/* The FAT type is defined purely by the cluster count */
+	if (fv->clusters < 4085)
+		fv->bits = 12;
+	else if (fv->clusters < 65525)
+		fv->bits = 16;
+	else
+		fv->bits = 32;
+
+	if (fv->bits == 32) {
+		fv->root_cluster = get_le32(bs + 44);
+		if (root_entries || !valid_cluster(fv, fv->root_cluster))
+			goto fail;
+	} else {
+		if (!root_entries)
+			goto fail;
+		fv->root_offset = (reserved + nfats * fat_sectors) * bps;
+		fv->root_size = root_sectors * bps;
+	}
+
+	/* Only read as much of the first FAT as the clusters need */
+	needed = ((uint64_t)(fv->clusters + 2) * fv->bits + 7) / 8 + 1;
+	if (needed > fat_sectors * bps)
+		goto fail;
+	fv->fat_size = needed;
+	fv->fat = xmalloc(fv->fat_size);
+	if (pread_full(fd, fv->fat, fv->fat_size, (uint64_t)reserved * bps))
+		goto fail;
+
+	pr_debug("FAT%d: %u clusters of %u bytes\n", fv->bits,
+			fv->clusters, fv->cluster_size);
+	return fv;
+fail:
+	pr_debug("unsupported or corrupt FAT boot sector\n");
+	fat_close(fv);
+	return NULL;
+}
+
+void fat_close(struct fat_volume *fv)
+{
+	if (!fv)
+		return;
+	free(fv->fat);
+	free(fv);
+}
+
+/* Read a directory into memory in one piece */
+static unsigned char *read_dir(struct fat_volume *fv, uint32_t cluster,
+		size_t *len)
+{
+	unsigned char *buf = NULL;
+	size_t size = 0;
+
+	if (!cluster) {
+		if (fv->bits != 32) {
+			buf = xmalloc(fv->root_size);
+			if (pread_full(fv->fd, buf, fv->root_size,
+						fv->root_offset)) {
+				free(buf);
+				return NULL;
+			}
+			*len = fv->root_size;
+			return buf;
+		}
+		cluster = fv->root_cluster;
+	}
+
+	while (cluster && size < FAT_MAX_DIR_SIZE) {
+		buf = xrealloc(buf, size + fv->cluster_size);
+		if (pread_full(fv->fd, buf + size, fv->cluster_size,
+					cluster_offset(fv, cluster))) {
+			free(buf);
+			return NULL;
+		}
+		size += fv->cluster_size;
+		cluster = fat_next(fv, cluster);
+	}
+	*len = size;
+	return buf;
+}
+
+static unsigned char lfn_checksum(const unsigned char *shortname)
+{
+	unsigned char sum = 0;
+	int i;
+
+	for (i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + shortname[i];
+	return sum;
+}
+
+static void lfn_add(struct lfn_state *lfn, const unsigned char *e)
+{
+	static const int offsets[FAT_LFN_CHARS] = {
+		1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+	};
+	int ord = e[0] & 0x1f;
+	int i, pos;
+
+	if (e[0] & 0x40) {
+		/* Last piece of the name comes first */
+		lfn->valid = ord && ord <= FAT_LFN_MAX_ENTRIES;
+		lfn->expect = ord;
+		lfn->len = ord * FAT_LFN_CHARS;
+		lfn->checksum = e[13];
+	}
+
+	if (!lfn->valid || ord != lfn->expect || e[13] != lfn->checksum) {
+		lfn->valid = false;
+		return;
+	}
+
+	pos = (ord - 1) * FAT_LFN_CHARS;
+	for (i = 0; i < FAT_LFN_CHARS; i++)
+		lfn->name[pos + i] = get_le16(e + offsets[i]);
+	lfn->expect--;
+}
+
+/* UCS-2 (with surrogate pairs) to UTF-8 */
+static char *lfn_to_utf8(struct lfn_state *lfn)
+{
+	char *out = xmalloc(lfn->len * 3 + 1);
+	char *pos = out;
+	int i;
+
+	for (i = 0; i < lfn->len && lfn->name[i]; i++) {
+		uint32_t c = lfn->name[i];
+
+		if (c >= 0xd800 && c < 0xdc00 && i + 1 < lfn->len &&
+				lfn->name[i + 1] >= 0xdc00 &&
+				lfn->name[i + 1] < 0xe000) {
+			c = 0x10000 + ((c - 0xd800) << 10) +
+				(lfn->name[++i] - 0xdc00);
+		}
+
+		if (c < 0x80) {
+			*pos++ = c;
+		} else if (c < 0x800) {
+			*pos++ = 0xc0 | (c >> 6);
+			*pos++ = 0x80 | (c & 0x3f);
+		} else if (c < 0x10000) {
+			*pos++ = 0xe0 | (c >> 12);
+			*pos++ = 0x80 | ((c >> 6) & 0x3f);
+			*pos++ = 0x80 | (c & 0x3f);
+		} else {
+			*pos++ = 0xf0 | (c >> 18);
+			*pos++ = 0x80 | ((c >> 12) & 0x3f);
+			*pos++ = 0x80 | ((c >> 6) & 0x3f);
+			*pos++ = 0x80 | (c & 0x3f);
+		}
+	}
+	*pos = '\0';
+	return out;
+}
+
+/* 8.3 name, honoring the lowercase flags Windows NT stores in byte 12 */
+static char *short_name(const unsigned char *e)
+{
+	char name[13];
+	int i, base, ext, n = 0;
+
+	for (base = 8; base > 0 && e[base - 1] == ' '; base--)
+		;
+	for (ext = 11; ext > 8 && e[ext - 1] == ' '; ext--)
+		;
+
+	for (i = 0; i < base; i++) {
+		unsigned char c = (i == 0 && e[0] == 0x05) ? 0xe5 : e[i];
+		name[n++] = (e[12] & FAT_LCASE_BASE) ? tolower(c) : c;
+	}
+	if (ext > 8) {
+		name[n++] = '.';
+		for (i = 8; i < ext; i++)
+			name[n++] = (e[12] & FAT_LCASE_EXT) ? tolower(e[i]) : e[i];
+	}
+	name[n] = '\0';
+	return xstrdup(name);
+}
+
+static void add_file(struct file_list *list, char *path, uint32_t cluster,
+		uint32_t size)
+{
+	struct fat_file *f;
+
+	if (list->count == list->alloc) {
+		list->alloc = list->alloc ? list->alloc * 2 : 32;
+		list->files = xrealloc(list->files,
+				list->alloc * sizeof(struct fat_file));
+	}
+	f = &list->files[list->count++];
+	f->path = path;
+	f->cluster = cluster;
+	f->size = size;
+}
+
+static int walk_dir(struct fat_volume *fv, uint32_t cluster,
+		const char *prefix, int depth, struct file_list *list)
+{
+	struct lfn_state lfn;
+	unsigned char *dir, *e;
+	size_t len, off;
+	int ret = 0;
+
+	if (depth > FAT_MAX_DEPTH) {
+		pr_error("FAT directories nested too deeply at %s\n", prefix);
+		return -1;
+	}
+
+	dir = read_dir(fv, cluster, &len);
+	if (!dir)
+		return -1;
+
+	lfn.valid = false;
+	for (off = 0; off + FAT_DIRENT_SIZE <= len && !ret;
+			off += FAT_DIRENT_SIZE) {
+		uint32_t child;
+		char *name, *path;
+
+		e = dir + off;
+		if (e[0] == 0x00)
+			break;
+		if (e[0] == 0xe5) {
+			lfn.valid = false;
+			continue;
+		}
+
+		if ((e[11] & 0x3f) == FAT_ATTR_LFN) {
+			lfn_add(&lfn, e);
+			continue;
+		}
+
+		if (lfn.valid && !lfn.expect &&
+				lfn_checksum(e) == lfn.checksum)
+			name = lfn_to_utf8(&lfn);
+		else
+			name = short_name(e);
+		lfn.valid = false;
+
+		if ((e[11] & FAT_ATTR_VOLUME_ID) || !strcmp(name, ".") ||
+				!strcmp(name, "..")) {
+			free(name);
+			continue;
+		}
+
+		path = prefix ? xasprintf("%s/%s", prefix, name) : xstrdup(name);
+		free(name);
+
+		child = get_le16(e + 26);
+		if (fv->bits == 32)
+			child |= get_le16(e + 20) << 16;
+
+		if (e[11] & FAT_ATTR_DIRECTORY) {
+			if (valid_cluster(fv, child))
+				ret = walk_dir(fv, child, path, depth + 1, list);
+			free(path);
+		} else {
+			add_file(list, path, child, get_le32(e + 28));
+		}
+	}
+
+	free(dir);
+	return ret;
+}
+
+int fat_list_files(struct fat_volume *fv, struct fat_file **files,
+		size_t *count)
+{
+	struct file_list list;
+
+	memset(&list, 0, sizeof(list));
+	if (walk_dir(fv, 0, NULL, 0, &list)) {
+		fat_free_files(list.files, list.count);
+		return -1;
+	}
+
+	*files = list.files;
+	*count = list.count;
+	return 0;
+}
+
+void fat_free_files(struct fat_file *files, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free(files[i].path);
+	free(files);
+}
+
+int fat_read_file(struct fat_volume *fv, const struct fat_file *file,
+		fat_read_cb cb, void *ctx)
+{
+	unsigned char *buf;
+	uint32_t remaining = file->size;
+	uint32_t cluster = file->cluster;
+	uint32_t visited = 0;
+	int ret = 0;
+
+	if (!remaining)
+		return 0;
+
+	buf = xmalloc(FAT_READ_MAX);
+	while (remaining) {
+		uint32_t start = cluster;
+		size_t run = fv->cluster_size;
+		size_t len;
+
+		if (!valid_cluster(fv, cluster) || ++visited > fv->clusters) {
+			pr_error("bad cluster chain in %s\n", file->path);
+			ret = -1;
+			break;
+		}
+
+		/* Coalesce physically contiguous clusters into one read */
+		while (run < remaining && run + fv->cluster_size <= FAT_READ_MAX) {
+			uint32_t next = fat_next(fv, cluster);
+
+			if (next != cluster + 1)
+				break;
+			cluster = next;
+			run += fv->cluster_size;
+			visited++;
+		}
+
+		len = min(run, (size_t)remaining);
+		if (pread_full(fv->fd, buf, len, cluster_offset(fv, start))) {
+			ret = -1;
+			break;
+		}
+
+		ret = cb(buf, len, ctx);
+		if (ret)
+			break;
+
+		remaining -= len;
+		if (remaining)
+			cluster = fat_next(fv, cluster);
+	}
+
+	free(buf);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
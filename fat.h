@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_FAT_H_
+#define _USERFASTBOOT_FAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimal read-only FAT12/16/32 reader, enough to enumerate and read
+ * files on the ESP without mounting it. Safe to read files from several
+ * threads at once. */
+
+struct fat_volume;
+
+struct fat_file {
+	char *path;		/* relative to the root, '/' separated */
+	uint32_t cluster;	/* first cluster, 0 for empty files */
+	uint32_t size;
+};
+
+/* Returns NULL if fd doesn't hold a FAT filesystem we understand */
+struct fat_volume *fat_open(int fd);
+void fat_close(struct fat_volume *fv);
+
+/* Recursively list all regular files. The caller frees the array with
+ * fat_free_files(). */
+int fat_list_files(struct fat_volume *fv, struct fat_file **files,
+		size_t *count);
+void fat_free_files(struct fat_file *files, size_t count);
+
+/* Stream a file's contents through cb in cluster-run sized pieces.
+ * A nonzero return from cb stops the read and is returned. */
+typedef int (*fat_read_cb)(const void *buf, size_t len, void *ctx);
+int fat_read_file(struct fat_volume *fv, const struct fat_file *file,
+		fat_read_cb cb, void *ctx);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -28,7 +28,13 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <linux/fs.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#include <poll.h>
 
+#include <cutils/hashmap.h>
 #include <cutils/properties.h>
 #include <fs_mgr.h>
 
@@ -42,6 +48,57 @@
 
 static struct fstab *fstab = NULL;
 
+/* Catalog of facts about each volume that are costly to look up and
+ * only change when the partition table does. Sizes and disks are
+ * filled in on first use and dropped by storage_catalog_invalidate().
+ * volume_info is indexed like fstab->recs. */
+struct volume_info {
+	uint64_t size;
+	bool size_valid;
+	char *disk;
+};
+
+static Hashmap *volume_names;
+static struct volume_info *volume_info;
+static char *primary_disk;
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Bumped by storage_catalog_invalidate(), so lookups done without the
+ * lock don't store what they found before the table changed */
+static unsigned int catalog_generation;
+
+static int str_hash(void *key)
+{
+	return hashmapHash(key, strlen(key));
+}
+
+static bool str_equals(void *keyA, void *keyB)
+{
+	return strcmp(keyA, keyB) == 0;
+}
+
+static struct volume_info *info_for_volume(struct fstab_rec *vol)
+{
+	if (!fstab || vol < fstab->recs || vol >= fstab->recs + fstab->num_entries)
+		return NULL;
+	return &volume_info[vol - fstab->recs];
+}
+
+void storage_catalog_invalidate(void)
+{
+	int i;
+
+	pthread_mutex_lock(&catalog_lock);
+	for (i = 0; fstab && i < fstab->num_entries; i++) {
+		free(volume_info[i].disk);
+		volume_info[i].disk = NULL;
+		volume_info[i].size_valid = false;
+	}
+	free(primary_disk);
+	primary_disk = NULL;
+	catalog_generation++;
+	pthread_mutex_unlock(&catalog_lock);
+}
+
 void load_volume_table()
 {
 	int i;
@@ -61,12 +118,25 @@ void load_volume_table()
 		return;
 	}
 
+	volume_info = xmalloc(fstab->num_entries * sizeof(*volume_info));
+	memset(volume_info, 0, fstab->num_entries * sizeof(*volume_info));
+	volume_names = hashmapCreate(fstab->num_entries * 2, str_hash,
+			str_equals);
+
 	pr_debug("recovery filesystem table\n");
 	pr_debug("=========================\n");
 	for (i = 0; i < fstab->num_entries; ++i) {
 		struct fstab_rec *v = &fstab->recs[i];
 		pr_debug("  %d %s %s %s %lld\n", i, v->mount_point, v->fs_type,
 			 v->blk_device, v->length);
+
+		/* recovery.fstab entries are all prefixed with '/'. A mount
+		 * point may be listed more than once (e.g. /data as ext4
+		 * and f2fs); like fs_mgr, the first one wins */
+		if (v->mount_point[0] == '/' &&
+				!hashmapContainsKey(volume_names,
+					v->mount_point + 1))
+			hashmapPut(volume_names, v->mount_point + 1, v);
 	}
 	printf("\n");
 }
@@ -78,22 +148,130 @@ struct fstab_rec *volume_for_path(const char *path)
 
 struct fstab_rec *volume_for_name(const char *name)
 {
-	char *pat;
-	struct fstab_rec *vol;
-
 	/* Historical: it's /data in recovery.fstab, but some fastboot
 	 * options (such as -w) expect it to be called userdata */
 	if (!strcmp("userdata", name))
 		name = "data";
 
-	/* recovery.fstab entries are all prefixed with '/' */
-	pat = xasprintf("/%s", name);
-	vol = volume_for_path(pat);
-	free(pat);
-	return vol;
+	if (!volume_names)
+		return NULL;
+	return hashmapGet(volume_names, (void *)name);
 }
 
-char *get_primary_disk_name(void)
+static int read_volume_size(struct fstab_rec *vol, uint64_t *sz)
+{
+	int fd;
+	int ret = -1;
+
+	fd = open(vol->blk_device, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (ioctl(fd, BLKGETSIZE64, sz) >= 0) {
+		ret = 0;
+		*sz += vol->length;
+	} else {
+		pr_perror("BLKGETSIZE64");
+	}
+	pr_verbose("size is %" PRIu64 "\n", *sz);
+	close(fd);
+	return ret;
+}
+
+int get_volume_size(struct fstab_rec *vol, uint64_t *sz)
+{
+	struct volume_info *info;
+	unsigned int gen;
+	int ret;
+
+	if (vol->length > 0) {
+		*sz = vol->length;
+		return 0;
+	}
+
+	info = info_for_volume(vol);
+	if (!info)
+		return read_volume_size(vol, sz);
+
+	pthread_mutex_lock(&catalog_lock);
+	if (info->size_valid) {
+		*sz = info->size;
+		pthread_mutex_unlock(&catalog_lock);
+		return 0;
+	}
+	gen = catalog_generation;
+	pthread_mutex_unlock(&catalog_lock);
+
+	/* Don't hold up other lookups while we go to the device; if two
+	 * threads race here they both read the same size */
+	ret = read_volume_size(vol, sz);
+	if (!ret) {
+		pthread_mutex_lock(&catalog_lock);
+		if (gen == catalog_generation) {
+			info->size = *sz;
+			info->size_valid = true;
+		}
+		pthread_mutex_unlock(&catalog_lock);
+	}
+	return ret;
+}
+
+/* sysfs directory of the whole disk a block device lives on, or the
+ * device path itself if it can't be worked out */
+static char *find_disk(const char *device)
+{
+	struct stat sb;
+	char *path, *real, *part, *slash;
+
+	if (stat(device, &sb) || !S_ISBLK(sb.st_mode))
+		return xstrdup(device);
+
+	path = xasprintf("/sys/dev/block/%u:%u", major(sb.st_rdev),
+			minor(sb.st_rdev));
+	real = realpath(path, NULL);
+	free(path);
+	if (!real)
+		return xstrdup(device);
+
+	part = xasprintf("%s/partition", real);
+	if (!access(part, F_OK)) {
+		slash = strrchr(real, '/');
+		if (slash)
+			*slash = '\0';
+	}
+	free(part);
+	return real;
+}
+
+char *get_volume_disk(struct fstab_rec *vol)
+{
+	struct volume_info *info;
+	unsigned int gen;
+	char *disk;
+
+	info = info_for_volume(vol);
+	if (!info)
+		return find_disk(vol->blk_device);
+
+	pthread_mutex_lock(&catalog_lock);
+	disk = info->disk ? xstrdup(info->disk) : NULL;
+	gen = catalog_generation;
+	pthread_mutex_unlock(&catalog_lock);
+	if (disk)
+		return disk;
+
+	/* Resolved outside the lock like the volume size; racing threads
+	 * find the same disk and the first one to finish is kept */
+	disk = find_disk(vol->blk_device);
+	pthread_mutex_lock(&catalog_lock);
+	if (!info->disk && gen == catalog_generation)
+		info->disk = xstrdup(disk);
+	pthread_mutex_unlock(&catalog_lock);
+	return disk;
+}
+
+static char *find_primary_disk(void)
 {
 	DIR *dir;
 	int64_t largest = 0;
@@ -157,57 +335,182 @@ char *get_primary_disk_name(void)
 	}
 
 	closedir(dir);
+	regfree(&diskreg);
+	return ret;
+}
+
+char *get_primary_disk_name(void)
+{
+	unsigned int gen;
+	char *ret;
+
+	pthread_mutex_lock(&catalog_lock);
+	ret = primary_disk ? xstrdup(primary_disk) : NULL;
+	gen = catalog_generation;
+	pthread_mutex_unlock(&catalog_lock);
+	if (ret)
+		return ret;
+
+	/* Scanning sysfs is slow and can die(), so don't do it with the
+	 * catalog locked */
+	ret = find_primary_disk();
+	if (!ret)
+		return NULL;
+	pthread_mutex_lock(&catalog_lock);
+	if (!primary_disk && gen == catalog_generation)
+		primary_disk = xstrdup(ret);
+	pthread_mutex_unlock(&catalog_lock);
 	return ret;
 }
 
 
-static void publish_part_data(bool wait, struct fstab_rec *v, char *name)
+/* How long to wait overall for ueventd to create partition nodes */
+#define DEVICE_WAIT_MS	15000
+
+static bool skip_volume(struct fstab_rec *v)
 {
-	char *buf;
-	uint64_t size;
+	/* Don't care about sd card slot and it may not even
+	 * be there, Skip anything that begins with /sdcard.
+	 * skip the fake /tmp entry too */
+	return !strncmp("/sdcard", v->mount_point, 7) ||
+			!strcmp("auto", v->mount_point) ||
+			!strcmp("/tmp", v->mount_point);
+}
+
+/* Watch the deepest existing directory on the way to path, so we hear
+ * about the node, or a missing directory above it, being created */
+static void watch_for_node(int ifd, const char *path)
+{
+	char *dir, *slash;
+
+	dir = xstrdup(path);
+	while ((slash = strrchr(dir, '/'))) {
+		if (slash == dir)
+			slash[1] = '\0';
+		else
+			*slash = '\0';
+		if (inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO) >= 0 ||
+				slash == dir)
+			break;
+	}
+	free(dir);
+}
+
+/* Wait for all the volumes' device nodes to show up after the partition
+ * table has been re-read. ueventd creates them in its own time; rather
+ * than polling each one in turn, check them all again whenever anything
+ * is created in a directory leading to one of them. */
+static void wait_for_volume_devices(void)
+{
+	bool *found;
+	int64_t start, remaining;
 	struct stat sb;
-	int ctr = 15;
+	struct pollfd pfd;
+	char events[4096];
+	int i, missing;
+	int ifd;
+
+	found = xmalloc(fstab->num_entries * sizeof(bool));
+	memset(found, 0, fstab->num_entries * sizeof(bool));
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd < 0)
+		pr_perror("inotify_init1");
+
+	start = now_ms();
+	for (;;) {
+		missing = 0;
+		for (i = 0; i < fstab->num_entries; i++) {
+			struct fstab_rec *v = &fstab->recs[i];
+
+			if (found[i] || skip_volume(v))
+				continue;
+
+			/* Add the watch before checking, so nothing created
+			 * in between is missed */
+			if (ifd >= 0)
+				watch_for_node(ifd, v->blk_device);
+			if (!stat(v->blk_device, &sb)) {
+				found[i] = true;
+				pr_debug("%s appeared after %" PRId64 " ms\n",
+						v->blk_device, now_ms() - start);
+				continue;
+			}
+			missing++;
+		}
+		if (!missing)
+			break;
+
+		remaining = DEVICE_WAIT_MS - (now_ms() - start);
+		if (remaining <= 0) {
+			pr_error("Gave up waiting for %d device nodes\n",
+					missing);
+			break;
+		}
 
-	/* Keep trying for ctr seconds for the device node to show up.
-	 * ueventd may be busy creating the node */
-	while (wait && ctr-- && stat(v->blk_device, &sb)) {
-		pr_debug("waiting for %s\n", v->blk_device);
-		sleep(1);
+		if (ifd < 0) {
+			sleep(1);
+			continue;
+		}
+		pfd.fd = ifd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, remaining) < 0 && errno != EINTR) {
+			pr_perror("poll");
+			break;
+		}
+		/* We recheck everything anyway, just drain the queue */
+		while (read(ifd, events, sizeof(events)) > 0)
+			;
 	}
+	pr_debug("waited %" PRId64 " ms for device nodes\n", now_ms() - start);
+
+	if (ifd >= 0)
+		close(ifd);
+	free(found);
+}
+
+/* Computed on demand, so it is right even after repartitioning */
+static char *get_partition_size(const char *name, void *ctx)
+{
+	uint64_t size;
+
+	if (get_volume_size(ctx, &size)) {
+		pr_debug("Couldn't get size for %s\n", name);
+		return xstrdup("0x0");
+	}
+	return xasprintf("0x%" PRIx64, size);
+}
+
+static void publish_part_data(struct fstab_rec *v, char *name)
+{
+	char *buf;
 
 	buf = xasprintf("partition-type:%s", name);
 	fastboot_publish(buf, xstrdup(v->fs_type));
 	free(buf);
 
 	buf = xasprintf("partition-size:%s", name);
-	if (get_volume_size(v, &size)) {
-		if (wait)
-			pr_error("Couldn't get %s volume size\n", name);
-		fastboot_publish(buf, xstrdup("0x0"));
-	} else {
-		fastboot_publish(buf, xasprintf("0x%" PRIx64, size));
-	}
+	fastboot_publish_getter(buf, get_partition_size, v, 0);
 	free(buf);
 }
 
 void publish_all_part_data(bool wait)
 {
 	int i;
+
+	if (wait)
+		wait_for_volume_devices();
+
 	for (i = 0; i < fstab->num_entries; i++) {
 		struct fstab_rec *v = &fstab->recs[i];
 
-		/* Don't care about sd card slot and it may not even
-		 * be there, Skip anything that begins with /sdcard.
-		 * skip the fake /tmp entry too */
-		if (!strncmp("/sdcard", v->mount_point, 7) ||
-				!strcmp("auto", v->mount_point) ||
-				!strcmp("/tmp", v->mount_point))
+		if (skip_volume(v))
 			continue;
 
-		publish_part_data(wait, v, v->mount_point + 1);
+		publish_part_data(v, v->mount_point + 1);
 		/* Historical */
 		if (!strcmp("/data", v->mount_point))
-			publish_part_data(wait, v, "userdata");
+			publish_part_data(v, "userdata");
 	}
 }
 
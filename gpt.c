@@ -24,6 +24,7 @@
 #include <linux/fs.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include <cutils/hashmap.h>
 #include <iniparser.h>
@@ -34,6 +35,7 @@
 #include "userfastboot_util.h"
 #include "userfastboot_ui.h"
 #include "fastboot.h"
+#include "hashes.h"
 
 #define _unused __attribute__((unused))
 
@@ -50,18 +52,6 @@ static uint64_t round_up_to_multiple(uint64_t val, uint64_t multiple)
 }
 
 
-static uint64_t to_unit_ceiling(uint64_t val, uint64_t unit)
-{
-	return round_up_to_multiple(val, unit) / unit;
-}
-
-
-static uint64_t to_mib(uint64_t val)
-{
-	return to_unit_ceiling(val, 1 << 20);
-}
-
-
 static uint64_t to_mib_floor(uint64_t val)
 {
 	return val >> 20;
@@ -148,9 +138,9 @@ static int string_to_type(char *type)
 struct flash_gpt_context {
 	struct gpt *gpt;
 	dictionary *config;
-	uint64_t size_mb;
-	uint64_t expand_mb;
-	uint64_t next_mb;
+	uint64_t align_lba;
+	uint64_t expand_lba;
+	uint64_t next_lba;
 	bool found;
 	int esp_index;
 	char *esp_title;
@@ -170,9 +160,13 @@ static bool sumsizes_cb(char *entry, int index _unused, void *data)
 		return false;
 	}
 
+	/* Lay the partitions out as create_ptn_cb will, with the -1
+	 * partition empty for now. Its final size is a multiple of the
+	 * alignment, so it won't change where anything after it goes. */
+	ctx->next_lba = round_up_to_multiple(ctx->next_lba, ctx->align_lba);
 	len = atoll(lenstr);
 	if (len > 0) {
-		ctx->size_mb += len;
+		ctx->next_lba += mib_to_lba(ctx->gpt, len);
 	} else {
 		if (ctx->found) {
 			pr_error("More than one partition with size -1 specified!\n");
@@ -188,7 +182,7 @@ static bool create_ptn_cb(char *entry, int i _unused, void *data)
 {
 	struct flash_gpt_context *ctx;
 	int64_t len;
-	uint64_t flags;
+	uint64_t flags, start_lba, len_lba;
 	char *label, *type, *flagstr, *guidstr;
 	struct gpt_entry *ge;
 	int type_code;
@@ -218,18 +212,20 @@ static bool create_ptn_cb(char *entry, int i _unused, void *data)
 	/* sumsizes_cb ensures that this value has been populated */
 	len = atoll(get_pdata(entry, "len", ctx->config));
 	if (len < 0)
-		len = ctx->expand_mb;
+		len_lba = ctx->expand_lba;
+	else
+		len_lba = mib_to_lba(ctx->gpt, len);
+	start_lba = round_up_to_multiple(ctx->next_lba, ctx->align_lba);
 
 	flagstr = get_pdata(entry, "flags", ctx->config);
 	flags = 0;
 	if (flagstr)
 		string_list_iterate(flagstr, flags_cb, &flags);
 
-	pr_verbose("Create partition %s at MiB %" PRIu64 " to %" PRIu64"\n", entry,
-			ctx->next_mb, ctx->next_mb + len);
+	pr_verbose("Create partition %s at LBA %" PRIu64 " to %" PRIu64"\n", entry,
+			start_lba, start_lba + len_lba - 1);
 	index = gpt_entry_create(ctx->gpt, label, type_code, flags,
-				mib_to_lba(ctx->gpt, ctx->next_mb),
-				mib_to_lba(ctx->gpt, ctx->next_mb + len) - 1);
+				start_lba, start_lba + len_lba - 1);
 	if (!index) {
 		pr_error("Couldn't create partition %s\n", entry);
 		return false;
@@ -271,10 +267,82 @@ static bool create_ptn_cb(char *entry, int i _unused, void *data)
 		}
 	}
 
-	ctx->next_mb += len;
+	ctx->next_lba = start_lba + len_lba;
 	return true;
 }
 
+static bool is_power_of_2(uint64_t val)
+{
+	return val && !(val & (val - 1));
+}
+
+/* Where partitions should start so that they don't straddle erase
+ * blocks or optimal I/O units. "alignment" in [base] is either a size
+ * in KiB or "auto", which takes the largest of 1 MiB and whatever the
+ * disk reports; a NULL config means auto. Returns 0 for an unusable
+ * configured value. */
+static uint64_t get_alignment(struct gpt *gpt, dictionary *config)
+{
+	static const char *attrs[] = {
+		"device/preferred_erase_size",
+		"queue/optimal_io_size",
+		"queue/discard_granularity",
+	};
+	char *conf, *end, *disk;
+	uint64_t align = 1 << 20;
+	int64_t val;
+	unsigned int i;
+
+	conf = config ? iniparser_getstring(config, "base:alignment", "auto") :
+			"auto";
+	if (strcmp(conf, "auto")) {
+		align = strtoull(conf, &end, 10) << 10;
+		if (*end || !align || align % gpt->lba_size) {
+			pr_error("Bad alignment '%s', expected KiB or auto\n",
+					conf);
+			return 0;
+		}
+		pr_info("Aligning partitions to %" PRIu64 " KiB\n",
+				align >> 10);
+		return align / gpt->lba_size;
+	}
+
+	disk = strrchr(gpt->device, '/');
+	disk = disk ? disk + 1 : gpt->device;
+	for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+		if (read_sysfs_int64(&val, "/sys/block/%s/%s", disk, attrs[i]) ||
+				val <= 0)
+			continue;
+		/* Sizes that aren't a power of two wouldn't keep the other
+		 * boundaries aligned */
+		if (!is_power_of_2(val) || val % gpt->lba_size) {
+			pr_debug("ignoring %s %s of %" PRId64 "\n", disk,
+					attrs[i], val);
+			continue;
+		}
+		pr_debug("%s %s is %" PRId64 "\n", disk, attrs[i], val);
+		align = max(align, (uint64_t)val);
+	}
+
+	pr_info("Aligning partitions on %s to %" PRIu64 " KiB\n", disk,
+			align >> 10);
+	return align / gpt->lba_size;
+}
+
+static char *get_primary_disk_device(void)
+{
+	char *disk_name, *device;
+
+	disk_name = get_primary_disk_name();
+	if (!disk_name) {
+		pr_error("Couldn't get primary disk name\n");
+		return NULL;
+	}
+	device = xasprintf("/dev/block/%s", disk_name);
+	free(disk_name);
+	return device;
+}
+
 #define MIN_DATA_PART_SIZE	350 /* CDD section 7.6.1 */
 
 int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz)
@@ -282,8 +350,7 @@ int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz)
 	int ret = -1;
 	char *device = NULL, *plist, *buf, *conf_device;
 	struct flash_gpt_context ctx;
-	uint64_t start_lba, end_lba, start_mb, end_mb;
-	uint64_t space_available_mb;
+	uint64_t start_lba, end_lba, available_lba;
 
 	memset(&ctx, 0, sizeof(ctx));
 
@@ -295,13 +362,9 @@ int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz)
 
 	conf_device = iniparser_getstring(ctx.config, "base:device", NULL);
 	if (!conf_device || !strcmp(conf_device, "auto")) {
-		char *disk_name = get_primary_disk_name();
-		if(!disk_name) {
-			pr_error("Couldn't get primary disk name\n");
+		device = get_primary_disk_device();
+		if (!device)
 			goto out;
-		}
-		device = xasprintf("/dev/block/%s", disk_name);
-		free(disk_name);
 	} else {
 		device = xstrdup(conf_device);
 	}
@@ -327,29 +390,34 @@ int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz)
 			PRIu64 " MiB\n", device, ctx.gpt->sectors, ctx.gpt->lba_size,
 			to_mib_floor(ctx.gpt->sectors * ctx.gpt->lba_size));
 
-	/* Find out the total size of the partitions specified, so that
+	ctx.align_lba = get_alignment(ctx.gpt, ctx.config);
+	if (!ctx.align_lba)
+		goto out_free_gpt;
+
+	/* Find out where the partitions specified end up, so that
 	 * if there is a partition with -1 size (typically /data) we
 	 * know how large to make it */
-	ctx.size_mb = 0;
+	gpt_find_contiguous_free_space(ctx.gpt, &start_lba, &end_lba);
+	ctx.next_lba = start_lba;
 	ctx.found = false;
 	if (string_list_iterate(plist, sumsizes_cb, &ctx)) {
 		pr_error("Couldn't sum up partition sizes\n");
 		goto out_free_gpt;
 	}
 
-	gpt_find_contiguous_free_space(ctx.gpt, &start_lba, &end_lba);
-	start_mb = to_mib(start_lba * ctx.gpt->lba_size);
-	end_mb = to_mib_floor((end_lba + 1) * ctx.gpt->lba_size);
-	space_available_mb = end_mb - start_mb;
-	if (space_available_mb < (ctx.size_mb + MIN_DATA_PART_SIZE)) {
+	available_lba = 0;
+	if (end_lba + 1 > ctx.next_lba)
+		available_lba = end_lba + 1 - ctx.next_lba;
+	if (available_lba < mib_to_lba(ctx.gpt, MIN_DATA_PART_SIZE)) {
 		pr_error("insufficient disk space\n");
 		goto out_free_gpt;
 	}
-	ctx.expand_mb = space_available_mb - ctx.size_mb;
-	if (ctx.expand_mb && !ctx.found)
-		pr_warning("Disk has %" PRIu64 " MiB of unused space!\n", ctx.expand_mb);
+	ctx.expand_lba = available_lba - (available_lba % ctx.align_lba);
+	if (ctx.expand_lba && !ctx.found)
+		pr_warning("Disk has %" PRIu64 " MiB of unused space!\n",
+				to_mib_floor(ctx.expand_lba * ctx.gpt->lba_size));
 
-	ctx.next_mb = start_mb;
+	ctx.next_lba = start_lba;
 	if (string_list_iterate(plist, create_ptn_cb, &ctx)) {
 		pr_error("Failed to create partitions\n");
 		goto out_free_gpt;
@@ -381,6 +449,7 @@ int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz)
 
 	if (gpt_sync_ptable(ctx.gpt->device))
 		pr_warning("Couldn't re-read GPT, please reboot!\n");
+	storage_catalog_invalidate();
 	publish_all_part_data(true);
 
 	if (efi_variables_supported()) {
@@ -409,6 +478,322 @@ out:
 	return ret;
 }
 
+/* Find a partition by its GPT label, 0 if there isn't one */
+static uint32_t find_entry(struct gpt *gpt, const char *label)
+{
+	struct gpt_entry *e;
+	uint32_t i;
+	char *name;
+	bool match;
+
+	partition_for_each(gpt, i, e) {
+		name = gpt_entry_get_name(e);
+		if (!name)
+			continue;
+		match = !strcmp(name, label);
+		free(name);
+		if (match)
+			return i;
+	}
+	return 0;
+}
+
+
+/* First LBA past the free space following a partition */
+static uint64_t next_used_lba(struct gpt *gpt, uint32_t index)
+{
+	struct gpt_entry *e, *self;
+	uint64_t next;
+	uint32_t i;
+
+	self = gpt_entry_get(index, gpt);
+	next = gpt->header.last_usable_lba + 1;
+	partition_for_each(gpt, i, e) {
+		if (i != index && e->first_lba > self->last_lba &&
+				e->first_lba < next)
+			next = e->first_lba;
+	}
+	return next;
+}
+
+
+static int parse_len(const char *str, int64_t *len)
+{
+	char *end;
+
+	*len = strtoll(str, &end, 10);
+	if (*end || (*len <= 0 && *len != -1)) {
+		pr_error("Bad size '%s', expected MiB or -1\n", str);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* add <label> <type> <MiB|-1> [flag...]
+ * Placed at the start of the largest free region, -1 fills it */
+static int gpt_op_add(struct gpt *gpt, int argc, char **argv)
+{
+	uint64_t start_lba, end_lba, limit, align, len_lba;
+	uint64_t flags = 0;
+	int64_t len;
+	int type_code;
+	int i;
+
+	if (argc < 4)
+		return -EINVAL;
+
+	if (find_entry(gpt, argv[1])) {
+		pr_error("Partition %s already exists\n", argv[1]);
+		return -1;
+	}
+
+	type_code = string_to_type(argv[2]);
+	if (type_code < 0) {
+		pr_error("unknown partition type %s\n", argv[2]);
+		return -1;
+	}
+
+	if (parse_len(argv[3], &len))
+		return -1;
+
+	for (i = 4; i < argc; i++)
+		if (!flags_cb(argv[i], i, &flags))
+			return -1;
+
+	align = get_alignment(gpt, NULL);
+	if (gpt_find_contiguous_free_space(gpt, &start_lba, &end_lba)) {
+		pr_error("No free space on disk\n");
+		return -1;
+	}
+	start_lba = round_up_to_multiple(start_lba, align);
+	limit = end_lba + 1 - (end_lba + 1) % align;
+	if (limit <= start_lba) {
+		pr_error("No free space on disk\n");
+		return -1;
+	}
+	if (len < 0) {
+		len_lba = limit - start_lba;
+	} else {
+		if ((uint64_t)len > to_mib_floor((limit - start_lba) *
+					gpt->lba_size)) {
+			pr_error("Only %" PRIu64 " MiB available\n",
+					to_mib_floor((limit - start_lba) *
+						gpt->lba_size));
+			return -1;
+		}
+		len_lba = mib_to_lba(gpt, len);
+	}
+
+	/* gpt_entry_create() doesn't check the disk bounds or overlaps
+	 * itself, it relies on the range being inside the free region
+	 * gpt_find_contiguous_free_space() returned */
+	if (!gpt_entry_create(gpt, argv[1], type_code, flags, start_lba,
+				start_lba + len_lba - 1)) {
+		pr_error("Couldn't create partition %s\n", argv[1]);
+		return -1;
+	}
+	hash_cache_invalidate(NULL);
+	return 0;
+}
+
+
+/* delete <label> */
+static int gpt_op_delete(struct gpt *gpt, int argc, char **argv)
+{
+	uint32_t index;
+
+	if (argc != 2)
+		return -EINVAL;
+
+	index = find_entry(gpt, argv[1]);
+	if (!index) {
+		pr_error("No partition %s\n", argv[1]);
+		return -1;
+	}
+	gpt_entry_delete(gpt, index);
+	hash_cache_invalidate(NULL);
+	return 0;
+}
+
+
+/* resize <label> <MiB|-1>
+ * Grows or shrinks in place; -1 takes all the free space after it */
+static int gpt_op_resize(struct gpt *gpt, int argc, char **argv)
+{
+	struct gpt_entry *e;
+	uint64_t start, limit, last, align;
+	uint32_t index;
+	int64_t len;
+
+	if (argc != 3)
+		return -EINVAL;
+
+	index = find_entry(gpt, argv[1]);
+	if (!index) {
+		pr_error("No partition %s\n", argv[1]);
+		return -1;
+	}
+	if (parse_len(argv[2], &len))
+		return -1;
+
+	e = gpt_entry_get(index, gpt);
+	start = e->first_lba;
+	limit = next_used_lba(gpt, index);
+	if (len < 0) {
+		/* Keep the end aligned, like cmd_flash_gpt does */
+		align = get_alignment(gpt, NULL);
+		if (limit - limit % align <= start) {
+			pr_error("No free space after %s\n", argv[1]);
+			return -1;
+		}
+		last = limit - limit % align - 1;
+	} else {
+		if ((uint64_t)len > to_mib_floor((limit - start) *
+					gpt->lba_size)) {
+			pr_error("Only %" PRIu64 " MiB available for %s\n",
+					to_mib_floor((limit - start) * gpt->lba_size),
+					argv[1]);
+			return -1;
+		}
+		last = start + mib_to_lba(gpt, len) - 1;
+	}
+
+	e->last_lba = last;
+	hash_cache_invalidate(NULL);
+	return 0;
+}
+
+
+/* rename <label> <new label> */
+static int gpt_op_rename(struct gpt *gpt, int argc, char **argv)
+{
+	uint32_t index;
+
+	if (argc != 3)
+		return -EINVAL;
+
+	index = find_entry(gpt, argv[1]);
+	if (!index) {
+		pr_error("No partition %s\n", argv[1]);
+		return -1;
+	}
+	if (find_entry(gpt, argv[2])) {
+		pr_error("Partition %s already exists\n", argv[2]);
+		return -1;
+	}
+	if (gpt_entry_set_name(gpt_entry_get(index, gpt), argv[2]))
+		return -1;
+
+	/* GPT labels don't map onto volume names */
+	hash_cache_invalidate(NULL);
+	return 0;
+}
+
+
+/* retype <label> <type> */
+static int gpt_op_retype(struct gpt *gpt, int argc, char **argv)
+{
+	uint32_t index;
+	int type_code;
+
+	if (argc != 3)
+		return -EINVAL;
+
+	index = find_entry(gpt, argv[1]);
+	if (!index) {
+		pr_error("No partition %s\n", argv[1]);
+		return -1;
+	}
+	type_code = string_to_type(argv[2]);
+	if (type_code < 0) {
+		pr_error("unknown partition type %s\n", argv[2]);
+		return -1;
+	}
+	gpt_entry_set_type(gpt_entry_get(index, gpt), type_code);
+	return 0;
+}
+
+
+struct gpt_op {
+	const char *name;
+	const char *usage;
+	int (*fn)(struct gpt *gpt, int argc, char **argv);
+};
+
+static struct gpt_op gpt_ops[] = {
+	{ "add", "add <label> <type> <MiB|-1> [flag...]", gpt_op_add },
+	{ "delete", "delete <label>", gpt_op_delete },
+	{ "resize", "resize <label> <MiB|-1>", gpt_op_resize },
+	{ "rename", "rename <label> <new label>", gpt_op_rename },
+	{ "retype", "retype <label> <type>", gpt_op_retype },
+};
+
+/* Apply a single change to the partition table already on the primary
+ * disk. Unlike flash:gpt, every other entry is left exactly where it
+ * is, so the partitions around it keep their contents. */
+int oem_gpt(int argc, char **argv)
+{
+	struct gpt *gpt = NULL;
+	struct gpt_op *op = NULL;
+	char *device = NULL;
+	unsigned int i;
+	int ret = -1;
+
+	if (argc >= 2) {
+		for (i = 0; i < sizeof(gpt_ops) / sizeof(gpt_ops[0]); i++) {
+			if (!strcmp(argv[1], gpt_ops[i].name)) {
+				op = &gpt_ops[i];
+				break;
+			}
+		}
+	}
+	if (!op) {
+		pr_error("Usage: gpt add|delete|resize|rename|retype ...\n");
+		return -1;
+	}
+
+	device = get_primary_disk_device();
+	if (!device)
+		return -1;
+
+	gpt = gpt_init(device);
+	if (!gpt) {
+		pr_error("Couldn't init gpt for %s\n", device);
+		goto out;
+	}
+
+	if (gpt_read(gpt)) {
+		pr_error("Couldn't read GPT from %s\n", device);
+		goto out;
+	}
+
+	ret = op->fn(gpt, argc - 1, argv + 1);
+	if (ret == -EINVAL)
+		pr_error("Usage: gpt %s\n", op->usage);
+	if (ret) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = -1;
+	if (gpt_write(gpt)) {
+		pr_error("Couldn't commit GPT to disk\n");
+		goto out;
+	}
+
+	if (gpt_sync_ptable(gpt->device))
+		pr_warning("Couldn't re-read GPT, please reboot!\n");
+	storage_catalog_invalidate();
+	publish_all_part_data(true);
+	ret = 0;
+out:
+	if (gpt)
+		gpt_close(gpt);
+	free(device);
+	return ret;
+}
+
 /* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
  */
 
@@ -3,4 +3,8 @@
 
 int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz);
 
+/* Edit a single entry in the on-disk GPT: add, delete, resize, rename
+ * or retype, see gpt_ops in gpt.c */
+int oem_gpt(int argc, char **argv);
+
 #endif
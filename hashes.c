@@ -40,29 +40,314 @@
 #include <stdio.h>
 #include <ftw.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <stdarg.h>
 
 #include <bootimg.h>
 #include <ext4_utils.h>
+#include <gpt/checksum.h>
 
 #include "hashes.h"
+#include "fat.h"
 #include "userfastboot_util.h"
 #include "userfastboot_ui.h"
 #include "ext4.h"
 #include "keystore.h"
+#include "xfer_stats.h"
 
 #define BOOT_SIGNATURE_MAX_SIZE  2048
 
-static void report_hash(const char *name, unsigned char *hash)
+/* Results of hashing one partition with one algorithm. A partition can
+ * produce several target/hash pairs (one per file on FAT). */
+struct hash_cache_entry {
+	char *ptn;		/* cache_key() of the partition */
+	char *name;		/* as requested, which the targets are named by */
+	const struct digest_alg *alg;
+	unsigned int generation;
+	unsigned int count;
+	char **targets;
+	char **hashes;
+	struct hash_cache_entry *next;
+};
+
+/* Write generations. An entry is only valid while the generation of its
+ * partition is the one sampled before hashing started, so a write that
+ * races with hashing can't leave a stale digest behind. */
+struct ptn_generation {
+	char *ptn;
+	unsigned int generation;
+	struct ptn_generation *next;
+};
+
+static pthread_mutex_t hash_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_cache_entry *hash_cache;
+static struct ptn_generation *ptn_generations;
+static unsigned int global_generation;
+
+static void free_cache_entry(struct hash_cache_entry *e)
 {
-	char *hashstr = xmalloc(SHA_DIGEST_LENGTH * 2 + 1);
-	char *pos;
-	int i;
+	unsigned int i;
+
+	for (i = 0; i < e->count; i++) {
+		free(e->targets[i]);
+		free(e->hashes[i]);
+	}
+	free(e->targets);
+	free(e->hashes);
+	free(e->ptn);
+	free(e->name);
+	free(e);
+}
+
+/* Partitions are cached and invalidated by fstab mount point, so names
+ * for the same volume (userdata and data) share one generation */
+static char *cache_key(const char *ptn)
+{
+	struct fstab_rec *vol = volume_for_name(ptn);
+
+	if (vol && vol->mount_point[0] == '/')
+		return xstrdup(vol->mount_point + 1);
+	return xstrdup(ptn);
+}
+
+/* Must hold hash_cache_lock */
+static unsigned int get_generation(const char *ptn)
+{
+	struct ptn_generation *g;
+
+	for (g = ptn_generations; g; g = g->next)
+		if (!strcmp(g->ptn, ptn))
+			return global_generation + g->generation;
+	return global_generation;
+}
+
+void hash_cache_invalidate(const char *name)
+{
+	struct hash_cache_entry **pos, *e;
+	struct ptn_generation *g;
+	char *ptn = name ? cache_key(name) : NULL;
+
+	pthread_mutex_lock(&hash_cache_lock);
+	if (!ptn) {
+		global_generation++;
+	} else {
+		for (g = ptn_generations; g; g = g->next)
+			if (!strcmp(g->ptn, ptn))
+				break;
+		if (!g) {
+			g = xmalloc(sizeof(*g));
+			g->ptn = xstrdup(ptn);
+			g->generation = 0;
+			g->next = ptn_generations;
+			ptn_generations = g;
+		}
+		g->generation++;
+	}
+
+	pos = &hash_cache;
+	while ((e = *pos)) {
+		if (!ptn || !strcmp(e->ptn, ptn)) {
+			*pos = e->next;
+			free_cache_entry(e);
+		} else {
+			pos = &e->next;
+		}
+	}
+	pthread_mutex_unlock(&hash_cache_lock);
+	free(ptn);
+}
+
+static struct hash_cache_entry *dup_cache_entry(struct hash_cache_entry *e)
+{
+	struct hash_cache_entry *copy;
+	unsigned int i;
+
+	copy = xmalloc(sizeof(*copy));
+	memset(copy, 0, sizeof(*copy));
+	copy->ptn = xstrdup(e->ptn);
+	copy->name = xstrdup(e->name);
+	copy->alg = e->alg;
+	copy->generation = e->generation;
+	copy->count = e->count;
+	copy->targets = xmalloc((e->count + 1) * sizeof(char *));
+	copy->hashes = xmalloc((e->count + 1) * sizeof(char *));
+	for (i = 0; i < e->count; i++) {
+		copy->targets[i] = xstrdup(e->targets[i]);
+		copy->hashes[i] = xstrdup(e->hashes[i]);
+	}
+	return copy;
+}
+
+/* Copy of the cached results for name, if there are any */
+static struct hash_cache_entry *hash_cache_lookup(const char *name,
+		const struct digest_alg *alg)
+{
+	struct hash_cache_entry *e;
+	struct hash_cache_entry *found = NULL;
+	char *ptn = cache_key(name);
+
+	pthread_mutex_lock(&hash_cache_lock);
+	for (e = hash_cache; e; e = e->next) {
+		if (e->alg != alg || strcmp(e->ptn, ptn) ||
+				strcmp(e->name, name) ||
+				e->generation != get_generation(ptn))
+			continue;
+
+		pr_debug("using cached %s hashes for /%s\n", alg->name, name);
+		found = dup_cache_entry(e);
+		break;
+	}
+	pthread_mutex_unlock(&hash_cache_lock);
+	free(ptn);
+	return found;
+}
+
+static struct hash_cache_entry *hash_cache_start(const char *ptn,
+		const struct digest_alg *alg)
+{
+	struct hash_cache_entry *e;
+
+	e = xmalloc(sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->ptn = cache_key(ptn);
+	e->name = xstrdup(ptn);
+	e->alg = alg;
+	pthread_mutex_lock(&hash_cache_lock);
+	e->generation = get_generation(e->ptn);
+	pthread_mutex_unlock(&hash_cache_lock);
+	return e;
+}
+
+/* Remember a copy of completed results, unless the partition was written
+ * while we were hashing it */
+static void hash_cache_store(struct hash_cache_entry *e)
+{
+	struct hash_cache_entry **pos, *old;
+
+	pthread_mutex_lock(&hash_cache_lock);
+	if (e->generation != get_generation(e->ptn)) {
+		pthread_mutex_unlock(&hash_cache_lock);
+		return;
+	}
+
+	pos = &hash_cache;
+	while ((old = *pos)) {
+		if (old->alg == e->alg && !strcmp(old->ptn, e->ptn) &&
+				!strcmp(old->name, e->name)) {
+			*pos = old->next;
+			free_cache_entry(old);
+		} else {
+			pos = &old->next;
+		}
+	}
+	old = dup_cache_entry(e);
+	old->next = hash_cache;
+	hash_cache = old;
+	pthread_mutex_unlock(&hash_cache_lock);
+}
+
+static void add_hash(struct hash_cache_entry *e, const char *name,
+		unsigned char *hash)
+{
+	e->targets = xrealloc(e->targets, (e->count + 1) * sizeof(char *));
+	e->hashes = xrealloc(e->hashes, (e->count + 1) * sizeof(char *));
+	e->targets[e->count] = xstrdup(name);
+	e->hashes[e->count] = digest_to_string(e->alg, hash);
+	e->count++;
+}
+
+/* Only works from the fastboot thread */
+static void report_hashes(struct hash_cache_entry *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < e->count; i++) {
+		fastboot_report("target: /%s", e->targets[i]);
+		fastboot_report("hash: %s", e->hashes[i]);
+	}
+}
+
+/* Everything hashed for one report shares a progress bar; the total
+ * grows as each target works out how much it has to read */
+struct hash_progress {
+	pthread_mutex_t lock;
+	uint64_t done;
+	uint64_t total;
+};
+
+static void progress_add(struct hash_progress *p, uint64_t done,
+		uint64_t total)
+{
+	pthread_mutex_lock(&p->lock);
+	p->done += done;
+	p->total += total;
+	if (p->total)
+		mui_set_progress((float)p->done / (float)p->total);
+	pthread_mutex_unlock(&p->lock);
+	xfer_add(XFER_HASH, done, total);
+}
+
+struct disk_slot {
+	char *disk;
+	int active;
+	struct disk_slot *next;
+};
+
+struct hash_report {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct disk_slot *disks;
+	struct hash_progress progress;
+};
+
+struct hash_target {
+	const char *ptn;
+	const struct digest_alg *alg;
+	struct hash_report *report;
+	struct disk_slot *disk;
+	struct hash_cache_entry *result;
+	bool started;
+	int ret;
+	char *error;
+	pthread_t thread;
+};
+
+/* Targets are hashed on their own threads, whose INFO lines never reach
+ * the host. The first error is kept for get_partition_hashes() to
+ * report after the join; all of them still go to the screen and log. */
+static void target_error(struct hash_target *t, const char *fmt, ...)
+{
+	va_list ap;
+	char *msg;
+
+	va_start(ap, fmt);
+	if (vasprintf(&msg, fmt, ap) < 0)
+		die_errno("vasprintf");
+	va_end(ap);
+
+	logger_write(LOGGER_ERROR, LOGGER_SCREEN, "%s", msg);
+	if (t->error)
+		free(msg);
+	else
+		t->error = msg;
+}
+
+static int open_target(struct hash_target *t)
+{
+	struct fstab_rec *vol;
+	int fd;
 
-	for (i = 0, pos = hashstr; i < SHA_DIGEST_LENGTH; i++, pos += 2)
-		snprintf(pos, 3, "%02x", hash[i]);
-	fastboot_info("target: /%s", name);
-	fastboot_info("hash: %s", hashstr);
-	free(hashstr);
+	vol = volume_for_name(t->ptn);
+	if (!vol) {
+		target_error(t, "volume %s not found\n", t->ptn);
+		return -1;
+	}
+
+	fd = open(vol->blk_device, O_RDONLY);
+	if (fd < 0)
+		target_error(t, "open failed: %s\n", strerror(errno));
+	return fd;
 }
 
 static int open_partition(const char *ptn)
@@ -84,47 +369,157 @@ static int open_partition(const char *ptn)
 
 #define CHUNK 1024 * 1024
 
-static int hash_fd(int fd, uint64_t len, unsigned char *hash)
+/* Number of CHUNK-sized buffers in flight between the reader thread and
+ * the hashing thread. Three lets the reader stay a full buffer ahead
+ * while the hasher works on another. */
+#define HASH_BUFFERS	3
+
+struct hash_pipeline {
+	int fd;
+	uint64_t len;
+	unsigned char *buf[HASH_BUFFERS];
+	ssize_t filled[HASH_BUFFERS];
+	int head;	/* next buffer the reader fills */
+	int tail;	/* next buffer the hasher consumes */
+	int count;	/* buffers filled but not yet hashed */
+	bool done;
+	bool error;
+	int read_errno;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *hash_reader_thread(void *data)
 {
-	unsigned char *blob;
-	ssize_t chunklen;
-	SHA_CTX sha_ctx;
-	int ret = -1;
-	uint64_t orig_len = len;
+	struct hash_pipeline *hp = data;
+	uint64_t offset = 0;
+
+	while (offset < hp->len) {
+		ssize_t chunklen;
+		int slot;
+		bool stop;
+
+		pthread_mutex_lock(&hp->lock);
+		while (hp->count == HASH_BUFFERS && !hp->error)
+			pthread_cond_wait(&hp->cond, &hp->lock);
+		slot = hp->head;
+		stop = hp->error;
+		pthread_mutex_unlock(&hp->lock);
+		if (stop)
+			break;
 
-	blob = xmalloc(CHUNK);
-	mui_show_progress(1.0, 0);
+		do {
+			chunklen = pread64(hp->fd, hp->buf[slot],
+					min((uint64_t)CHUNK, hp->len - offset),
+					offset);
+		} while (chunklen < 0 && errno == EINTR);
+
+		pthread_mutex_lock(&hp->lock);
+		if (chunklen < 0) {
+			hp->read_errno = errno;
+			hp->error = true;
+		} else if (chunklen > 0) {
+			hp->filled[slot] = chunklen;
+			hp->head = (slot + 1) % HASH_BUFFERS;
+			hp->count++;
+		}
+		pthread_cond_broadcast(&hp->cond);
+		pthread_mutex_unlock(&hp->lock);
+
+		if (chunklen <= 0)
+			break;
+		offset += chunklen;
+	}
+
+	pthread_mutex_lock(&hp->lock);
+	hp->done = true;
+	pthread_cond_broadcast(&hp->cond);
+	pthread_mutex_unlock(&hp->lock);
+	return NULL;
+}
 
-	if (lseek64(fd, 0, SEEK_SET) < 0) {
-		pr_perror("lseek64");
+/* Hash the first len bytes of fd. A reader thread keeps up to
+ * HASH_BUFFERS chunks queued so that disk reads overlap with hashing
+ * and the throughput approaches the slower of the two. */
+static int hash_fd(struct hash_target *t, int fd, uint64_t len,
+		unsigned char *hash)
+{
+	struct hash_progress *progress = &t->report->progress;
+	struct hash_pipeline hp;
+	pthread_t reader;
+	struct digest_ctx ctx;
+	int ret = -1;
+	int i;
+	uint64_t hashed = 0;
+
+	memset(&hp, 0, sizeof(hp));
+	hp.fd = fd;
+	hp.len = len;
+	pthread_mutex_init(&hp.lock, NULL);
+	pthread_cond_init(&hp.cond, NULL);
+	for (i = 0; i < HASH_BUFFERS; i++)
+		hp.buf[i] = xmalloc(CHUNK);
+
+	/* Let the kernel read ahead aggressively; we're going to stream
+	 * through the whole range exactly once */
+	posix_fadvise(fd, 0, len, POSIX_FADV_SEQUENTIAL);
+	readahead(fd, 0, HASH_BUFFERS * CHUNK);
+
+	digest_init(&ctx, t->alg);
+	progress_add(progress, 0, len);
+
+	if (pthread_create(&reader, NULL, hash_reader_thread, &hp)) {
+		target_error(t, "pthread_create failed: %s\n",
+				strerror(errno));
 		goto out;
 	}
 
-	SHA1_Init(&sha_ctx);
+	for (;;) {
+		int slot;
 
-	while (len) {
-		mui_set_progress((float)(orig_len - len)/(float)orig_len);
-		chunklen = read(fd, blob, min(CHUNK, len));
-		if (chunklen < 0) {
-			pr_perror("read");
-			goto out;
-		}
-		if (chunklen == 0)
+		pthread_mutex_lock(&hp.lock);
+		while (!hp.count && !hp.done && !hp.error)
+			pthread_cond_wait(&hp.cond, &hp.lock);
+		if (hp.error || !hp.count) {
+			pthread_mutex_unlock(&hp.lock);
 			break;
-		SHA1_Update(&sha_ctx, blob, chunklen);
-		len -= chunklen;
+		}
+		slot = hp.tail;
+		pthread_mutex_unlock(&hp.lock);
+
+		digest_update(&ctx, hp.buf[slot], hp.filled[slot]);
+		hashed += hp.filled[slot];
+		progress_add(progress, hp.filled[slot], 0);
+
+		pthread_mutex_lock(&hp.lock);
+		hp.tail = (slot + 1) % HASH_BUFFERS;
+		hp.count--;
+		pthread_cond_broadcast(&hp.cond);
+		pthread_mutex_unlock(&hp.lock);
+	}
+	pthread_join(reader, NULL);
+
+	if (hp.error) {
+		target_error(t, "read failed: %s\n", strerror(hp.read_errno));
+		goto out;
+	}
+
+	if (hashed != len) {
+		target_error(t, "short read? remaining %"PRIu64"\n",
+				len - hashed);
+		goto out;
 	}
-	if (len) {
-		pr_error("short read? remaining %"PRIu64"\n", len);
-                goto out;
-        }
 
-	SHA1_Final(hash, &sha_ctx);
+	digest_final(&ctx, hash);
 	ret = 0;
 out:
-	mui_reset_progress();
+	/* Account for anything we didn't get to */
+	progress_add(progress, len - hashed, 0);
 
-	free(blob);
+	for (i = 0; i < HASH_BUFFERS; i++)
+		free(hp.buf[i]);
+	pthread_cond_destroy(&hp.cond);
+	pthread_mutex_destroy(&hp.lock);
 	return ret;
 }
 
@@ -148,7 +543,7 @@ static size_t unsigned_bootimage_size(struct boot_img_hdr *aosp_header)
 }
 
 
-static ssize_t get_bootimage_len(int fd)
+static ssize_t get_bootimage_len(struct hash_target *t, int fd)
 {
 	struct boot_img_hdr hdr;
 	ssize_t len;
@@ -156,29 +551,30 @@ static ssize_t get_bootimage_len(int fd)
 	struct boot_signature *bs;
 
 	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
-		pr_perror("read fd");
+		target_error(t, "read fd failed: %s\n", strerror(errno));
 		return -1;
 	}
 
         if (strncmp(BOOT_MAGIC, (char *)hdr.magic, BOOT_MAGIC_SIZE)) {
-		pr_error("bad boot magic\n");
+		target_error(t, "bad boot magic\n");
                 return -1;
 	}
 
 	len = unsigned_bootimage_size(&hdr);
 	if (len < 0) {
-		pr_error("couldn't compute boot image size\n");
+		target_error(t, "couldn't compute boot image size\n");
 		return -1;
 	}
 
 	if (lseek64(fd, len, SEEK_SET) < 0) {
-		pr_perror("lseek64");
+		target_error(t, "lseek64 failed: %s\n", strerror(errno));
 		return -1;
 	}
 
 	/* Now try to parse the boot image signature */
 	if (read(fd, sigbuf, BOOT_SIGNATURE_MAX_SIZE) != BOOT_SIGNATURE_MAX_SIZE) {
-		pr_perror("read sig data");
+		target_error(t, "read sig data failed: %s\n",
+				strerror(errno));
 		return -1;
 	}
 
@@ -195,75 +591,281 @@ static ssize_t get_bootimage_len(int fd)
 }
 
 
-static int ftw_callback(const char *fpath, const struct stat *sb, int typeflag)
+#define FILE_HASH_MAX_THREADS	8
+
+/* Files are either read straight from the FAT on the block device, or,
+ * if we don't understand the filesystem, through a read-only mount */
+struct file_hash_job {
+	struct fat_volume *fv;
+	const char *mountpoint;
+	const struct digest_alg *alg;
+	struct fat_file *files;
+	size_t count;
+	size_t next;
+	unsigned char *hashes;	/* count * DIGEST_MAX_LENGTH */
+	bool *hashed;
+	struct hash_progress *progress;
+	pthread_mutex_t lock;
+};
+
+static int digest_cb(const void *buf, size_t len, void *ctx)
 {
+	digest_update(ctx, buf, len);
+	return 0;
+}
+
+static int hash_mounted_file(const char *path, struct digest_ctx *ctx)
+{
+	unsigned char *buf;
+	ssize_t len;
 	int fd;
-	unsigned char hash[SHA_DIGEST_LENGTH];
+	int ret = -1;
 
-	if (typeflag != FTW_F)
-		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("open");
+		return -1;
+	}
 
-	fd = open(fpath, O_RDONLY);
-	if (fd < 0)
-		return 0;
+	buf = xmalloc(CHUNK);
+	while ((len = robust_read(fd, buf, CHUNK, true)) > 0)
+		digest_update(ctx, buf, len);
+	if (!len)
+		ret = 0;
 
-	if (!hash_fd(fd, sb->st_size, hash))
-		report_hash(fpath + 5, hash);
+	free(buf);
 	close(fd);
-	return 0;
+	return ret;
 }
 
+static void *file_hash_thread(void *data)
+{
+	struct file_hash_job *job = data;
+
+	for (;;) {
+		struct fat_file *f;
+		struct digest_ctx ctx;
+		size_t i;
+		int ret;
+
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->count)
+			break;
+		f = &job->files[i];
+
+		digest_init(&ctx, job->alg);
+		if (job->fv) {
+			ret = fat_read_file(job->fv, f, digest_cb, &ctx);
+		} else {
+			char *path = xasprintf("%s/%s", job->mountpoint, f->path);
+			ret = hash_mounted_file(path, &ctx);
+			free(path);
+		}
+
+		if (!ret) {
+			digest_final(&ctx, job->hashes + i * DIGEST_MAX_LENGTH);
+			job->hashed[i] = true;
+		}
+		progress_add(job->progress, f->size, 0);
+	}
+	return NULL;
+}
 
-int get_fat_file_hashes(const char *ptn)
+static int cmp_fat_file(const void *p1, const void *p2)
 {
-	struct fstab_rec *vol;
-	int fd;
+	const struct fat_file *f1 = p1;
+	const struct fat_file *f2 = p2;
+
+	return strcmp(f1->path, f2->path);
+}
+
+/* There's one mount point for the fallback path, and ftw() has no way
+ * to pass context to the callback, so only one target may use it at
+ * a time */
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fat_file *ftw_files;
+static size_t ftw_count;
+static const char *ftw_root;
+
+static int ftw_callback(const char *fpath, const struct stat *sb, int typeflag)
+{
+	if (typeflag != FTW_F)
+		return 0;
+
+	ftw_files = xrealloc(ftw_files, (ftw_count + 1) * sizeof(struct fat_file));
+	ftw_files[ftw_count].path = xstrdup(fpath + strlen(ftw_root) + 1);
+	ftw_files[ftw_count].cluster = 0;
+	ftw_files[ftw_count].size = sb->st_size;
+	ftw_count++;
+	return 0;
+}
+
+/* Hash every file on a FAT partition, several files at a time, sorted
+ * by path so the output can be compared between runs */
+static int fat_file_hashes(struct hash_target *t, struct fstab_rec *vol)
+{
+	struct file_hash_job job;
+	pthread_t threads[FILE_HASH_MAX_THREADS];
 	bool mounted = false;
+	char *mountpoint = NULL;
+	uint64_t total = 0;
+	long ncpus;
+	int fd = -1;
+	int nthreads, started;
 	int ret = -1;
+	size_t i;
 
-	pr_status("Hashing files under /%s\n", ptn);
+	memset(&job, 0, sizeof(job));
+	job.alg = t->alg;
+	job.progress = &t->report->progress;
+	pthread_mutex_init(&job.lock, NULL);
 
-	vol = volume_for_name(ptn);
-	if (!vol) {
-		pr_error("volume %s not found\n", ptn);
-		goto out;
+	fd = open(vol->blk_device, O_RDONLY);
+	if (fd >= 0) {
+		/* Files may have been written through a mount since we last
+		 * read the device; drop any stale cached blocks */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		job.fv = fat_open(fd);
 	}
 
-	if (mount_partition(vol, true))
-		goto out;
-	mounted = true;
+	if (job.fv) {
+		if (fat_list_files(job.fv, &job.files, &job.count)) {
+			target_error(t, "couldn't list the files on /%s\n",
+					t->ptn);
+			goto out;
+		}
+	} else {
+		pr_debug("reading /%s through a mount\n", t->ptn);
+		pthread_mutex_lock(&mount_lock);
+		if (mount_partition(vol, true)) {
+			pthread_mutex_unlock(&mount_lock);
+			target_error(t, "couldn't mount /%s\n", t->ptn);
+			goto out;
+		}
+		mounted = true;
+
+		/* Same path mount_partition() used */
+		mountpoint = xasprintf("/mnt/%s", vol->mount_point);
+		job.mountpoint = ftw_root = mountpoint;
+		ftw_files = NULL;
+		ftw_count = 0;
+		if (ftw(ftw_root, ftw_callback, 8)) {
+			target_error(t, "ftw failed: %s\n", strerror(errno));
+			fat_free_files(ftw_files, ftw_count);
+			goto out;
+		}
+		job.files = ftw_files;
+		job.count = ftw_count;
+	}
+
+	qsort(job.files, job.count, sizeof(struct fat_file), cmp_fat_file);
+	job.hashes = xmalloc(job.count * DIGEST_MAX_LENGTH + 1);
+	job.hashed = xmalloc(job.count * sizeof(bool) + 1);
+	memset(job.hashed, 0, job.count * sizeof(bool));
+	for (i = 0; i < job.count; i++)
+		total += job.files[i].size;
+	progress_add(job.progress, 0, total);
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = (ncpus > 0) ? min(ncpus, (long)FILE_HASH_MAX_THREADS) : 1;
+	if ((size_t)nthreads > job.count)
+		nthreads = job.count;
+
+	for (started = 0; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, file_hash_thread,
+					&job)) {
+			pr_perror("pthread_create");
+			break;
+		}
+	}
+	/* If no thread could be started, do the work here */
+	if (!started && job.count)
+		file_hash_thread(&job);
+	while (started--)
+		pthread_join(threads[started], NULL);
 
-	ftw("/mnt/bootloader", ftw_callback, 8);
 	ret = 0;
+	for (i = 0; i < job.count; i++) {
+		char *name;
+
+		if (!job.hashed[i]) {
+			if (!ret)
+				target_error(t, "couldn't read %s\n",
+						job.files[i].path);
+			pr_debug("couldn't hash %s/%s\n", t->ptn,
+					job.files[i].path);
+			ret = -1;
+			continue;
+		}
+		name = xasprintf("%s/%s", t->ptn, job.files[i].path);
+		add_hash(t->result, name, job.hashes + i * DIGEST_MAX_LENGTH);
+		free(name);
+	}
 out:
-	if (mounted)
+	if (mounted) {
 		unmount_partition(vol);
+		pthread_mutex_unlock(&mount_lock);
+	}
+	free(mountpoint);
+	fat_close(job.fv);
+	if (fd >= 0)
+		close(fd);
+	fat_free_files(job.files, job.count);
+	free(job.hashes);
+	free(job.hashed);
+	pthread_mutex_destroy(&job.lock);
 	return ret;
 }
 
-int get_boot_image_hash(const char *ptn)
+static int boot_image_hash(struct hash_target *t)
 {
-	char *device;
-	struct fstab_rec *vol;
 	int fd = -1;
 	int ret = -1;
 	int64_t len;
-	unsigned char hash[SHA_DIGEST_LENGTH];
-
-	pr_status("Hashing boot image /%s\n", ptn);
+	unsigned char hash[DIGEST_MAX_LENGTH];
 
-	fd = open_partition(ptn);
+	fd = open_target(t);
 	if (fd < 0)
 		goto out;
 
-	len = get_bootimage_len(fd);
+	len = get_bootimage_len(t, fd);
 	if (len < 0)
 		goto out;
 
-	if (hash_fd(fd, len, hash))
+	if (hash_fd(t, fd, len, hash))
 		goto out;
 
-	report_hash(ptn, hash);
+	add_hash(t->result, t->ptn, hash);
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/* Partitions with no structure we know about are hashed in full */
+static int raw_image_hash(struct hash_target *t, struct fstab_rec *vol)
+{
+	int fd = -1;
+	int ret = -1;
+	uint64_t len;
+	unsigned char hash[DIGEST_MAX_LENGTH];
+
+	if (get_volume_size(vol, &len)) {
+		target_error(t, "couldn't get size of /%s\n", t->ptn);
+		goto out;
+	}
+
+	fd = open_target(t);
+	if (fd < 0)
+		goto out;
+
+	if (hash_fd(t, fd, len, hash))
+		goto out;
+
+	add_hash(t->result, t->ptn, hash);
 	ret = 0;
 out:
 	if (fd >= 0)
@@ -320,65 +922,737 @@ uint64_t verity_tree_size(uint64_t data_size)
 }
 
 
-int get_ext_image_hash(const char *ptn)
+/* read_ext() fills in a libext4_utils global */
+static pthread_mutex_t ext_info_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ext_image_hash(struct hash_target *t)
 {
 	int fd = -1;
 	int ret = -1;
 	uint64_t len;
-	unsigned char hash[SHA_DIGEST_LENGTH];
+	unsigned char hash[DIGEST_MAX_LENGTH];
 	unsigned int magic_number;
 	int protocol_version;
 
-	pr_status("Hashing ext image /%s\n", ptn);
-
-	fd = open_partition(ptn);
+	fd = open_target(t);
 	if (fd < 0)
 		goto out;
 
+	pthread_mutex_lock(&ext_info_lock);
 	if (read_ext(fd, 1)) {
-		pr_error("ext image corrupted\n");
+		pthread_mutex_unlock(&ext_info_lock);
+		target_error(t, "ext image corrupted\n");
 		goto out;
 	}
-
-	/* info is a libext4_utils global populated by read_ext() */
 	len = info.len;
+	pthread_mutex_unlock(&ext_info_lock);
 
 	if (lseek64(fd, len, SEEK_SET) < 0) {
-		pr_perror("lseek64");
+		target_error(t, "lseek64 failed: %s\n", strerror(errno));
 		goto out;
 	}
 
 	if (read(fd, &magic_number, sizeof(magic_number)) !=
 			(ssize_t)sizeof(magic_number)) {
-		pr_error("can't read verity magic\n");
+		target_error(t, "can't read verity magic\n");
 		goto out;
 	}
 
 	if (magic_number != VERITY_METADATA_MAGIC_NUMBER) {
-		pr_error("verity magic not found\n");
+		target_error(t, "verity magic not found\n");
 		goto out;
 	}
 
 	if (read(fd, &protocol_version, sizeof(protocol_version)) !=
 			(ssize_t)sizeof(protocol_version)) {
-		pr_debug("can't read protocol version\n");
+		target_error(t, "can't read protocol version\n");
 		goto out;
 	}
 
 	if (protocol_version != 0) {
-		pr_error("Unsupported verity protocol version %d\n",
+		target_error(t, "Unsupported verity protocol version %d\n",
 				protocol_version);
 		goto out;
 	}
 
 	len += verity_tree_size(len) + VERITY_METADATA_SIZE;
 
-	pr_debug("%s filesystem size %"PRIu64"\n", ptn, len);
-	if (hash_fd(fd, len, hash))
+	pr_debug("%s filesystem size %"PRIu64"\n", t->ptn, len);
+	if (hash_fd(t, fd, len, hash))
+		goto out;
+
+	add_hash(t->result, t->ptn, hash);
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int hash_target(struct hash_target *t)
+{
+	struct fstab_rec *vol;
+	char magic[BOOT_MAGIC_SIZE];
+	int fd;
+	bool boot;
+
+	vol = volume_for_name(t->ptn);
+	if (!vol) {
+		target_error(t, "volume %s not found\n", t->ptn);
+		return -1;
+	}
+
+	if (!strcmp(vol->fs_type, "vfat"))
+		return fat_file_hashes(t, vol);
+	if (!strcmp(vol->fs_type, "ext4"))
+		return ext_image_hash(t);
+
+	/* These must hold a valid boot image; if they don't, that's a
+	 * failure rather than raw data to hash */
+	if (!strcmp(t->ptn, "boot") || !strcmp(t->ptn, "recovery"))
+		return boot_image_hash(t);
+
+	fd = open_target(t);
+	if (fd < 0)
+		return -1;
+	boot = read(fd, magic, BOOT_MAGIC_SIZE) == BOOT_MAGIC_SIZE &&
+		!memcmp(magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+	close(fd);
+
+	return boot ? boot_image_hash(t) : raw_image_hash(t, vol);
+}
+
+#define HASH_TARGETS_PER_DISK	2
+
+static struct disk_slot *get_disk_slot(struct hash_report *r, const char *ptn)
+{
+	struct fstab_rec *vol;
+	struct disk_slot *d;
+	char *disk;
+
+	/* Targets on different disks are read in parallel, while
+	 * targets sharing one are limited so they don't thrash it */
+	vol = volume_for_name(ptn);
+	disk = vol ? get_volume_disk(vol) : xstrdup(ptn);
+
+	for (d = r->disks; d; d = d->next) {
+		if (!strcmp(d->disk, disk)) {
+			free(disk);
+			return d;
+		}
+	}
+
+	d = xmalloc(sizeof(*d));
+	d->disk = disk;
+	d->active = 0;
+	d->next = r->disks;
+	r->disks = d;
+	return d;
+}
+
+static void *hash_target_thread(void *data)
+{
+	struct hash_target *t = data;
+	struct hash_report *r = t->report;
+
+	t->result = hash_cache_lookup(t->ptn, t->alg);
+	if (t->result)
+		return NULL;
+	t->result = hash_cache_start(t->ptn, t->alg);
+
+	pthread_mutex_lock(&r->lock);
+	while (t->disk->active >= HASH_TARGETS_PER_DISK)
+		pthread_cond_wait(&r->cond, &r->lock);
+	t->disk->active++;
+	pthread_mutex_unlock(&r->lock);
+
+	t->ret = hash_target(t);
+
+	pthread_mutex_lock(&r->lock);
+	t->disk->active--;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	if (!t->ret)
+		hash_cache_store(t->result);
+	return NULL;
+}
+
+/* Hash all the given partitions at once, a few at a time per disk, then
+ * report the results in the order they were asked for */
+int get_partition_hashes(char **ptns, int count, const struct digest_alg *alg)
+{
+	struct hash_report report;
+	struct hash_target *targets;
+	struct disk_slot *d;
+	int i;
+	int ret = 0;
+
+	memset(&report, 0, sizeof(report));
+	pthread_mutex_init(&report.lock, NULL);
+	pthread_cond_init(&report.cond, NULL);
+	pthread_mutex_init(&report.progress.lock, NULL);
+
+	targets = xmalloc(count * sizeof(*targets) + 1);
+	memset(targets, 0, count * sizeof(*targets));
+	for (i = 0; i < count; i++) {
+		targets[i].ptn = ptns[i];
+		targets[i].alg = alg;
+		targets[i].report = &report;
+		targets[i].disk = get_disk_slot(&report, ptns[i]);
+	}
+
+	pr_status("Computing %s hashes of %d partitions\n", alg->name, count);
+	mui_show_progress(1.0, 0);
+	xfer_start(XFER_HASH, 0);
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&targets[i].thread, NULL,
+					hash_target_thread, &targets[i])) {
+			pr_perror("pthread_create");
+			hash_target_thread(&targets[i]);
+			continue;
+		}
+		targets[i].started = true;
+	}
+	for (i = 0; i < count; i++) {
+		if (targets[i].started)
+			pthread_join(targets[i].thread, NULL);
+	}
+	xfer_finish(XFER_HASH);
+	mui_reset_progress();
+
+	for (i = 0; i < count; i++) {
+		struct hash_target *t = &targets[i];
+
+		if (t->result) {
+			report_hashes(t->result);
+			free_cache_entry(t->result);
+		}
+		if (t->ret) {
+			if (t->error)
+				pr_error("couldn't hash /%s: %s", t->ptn,
+						t->error);
+			else
+				pr_error("couldn't hash /%s\n", t->ptn);
+			ret = -1;
+		}
+		free(t->error);
+	}
+
+	while ((d = report.disks)) {
+		report.disks = d->next;
+		free(d->disk);
+		free(d);
+	}
+	free(targets);
+	pthread_mutex_destroy(&report.progress.lock);
+	pthread_cond_destroy(&report.cond);
+	pthread_mutex_destroy(&report.lock);
+	return ret;
+}
+
+#define CHECKSUM_ALIGN		4096
+#define CHECKSUM_CHUNK		(4 * 1024 * 1024)
+
+/* CRC32, CRC32C and XXH64 of a byte range of a partition in one pass.
+ * The device is read with O_DIRECT in large aligned chunks so we checksum
+ * what is on the media rather than the page cache. len 0 means up to the
+ * end of the partition. */
+int checksum_partition(const char *ptn, uint64_t offset, uint64_t len)
+{
+	struct fstab_rec *vol;
+	struct xxh64_state xxh;
+	uint32_t crc = 0, crcc = 0;
+	uint64_t size, pos, end, skip, avail, done = 0;
+	unsigned char *buf = NULL;
+	ssize_t r;
+	size_t want, got;
+	bool direct = true;
+	int fd = -1, bfd = -1, rfd;
+	int ret = -1;
+
+	vol = volume_for_name(ptn);
+	if (!vol) {
+		pr_error("volume %s not found\n", ptn);
+		return -1;
+	}
+	if (get_volume_size(vol, &size)) {
+		pr_error("couldn't get size of /%s\n", ptn);
+		return -1;
+	}
+	if (offset > size || len > size - offset) {
+		pr_error("range is past the end of /%s (%" PRIu64 " bytes)\n",
+				ptn, size);
+		return -1;
+	}
+	if (!len)
+		len = size - offset;
+
+	fd = open(vol->blk_device, O_RDONLY | O_DIRECT);
+	if (fd < 0) {
+		pr_debug("O_DIRECT open of %s failed, using buffered I/O\n",
+				vol->blk_device);
+		fd = open(vol->blk_device, O_RDONLY);
+		direct = false;
+	}
+	if (fd < 0) {
+		pr_perror("open");
+		return -1;
+	}
+
+	if (posix_memalign((void **)&buf, CHECKSUM_ALIGN, CHECKSUM_CHUNK)) {
+		pr_error("out of memory\n");
+		buf = NULL;
 		goto out;
+	}
+
+	/* Direct I/O wants aligned offsets and lengths, so start at the
+	 * block containing offset and drop the bytes before it */
+	xxh64_init(&xxh, 0);
+	pos = offset - (offset % CHECKSUM_ALIGN);
+	skip = offset - pos;
+	end = offset + len;
+	mui_show_progress(1.0, 0);
+	xfer_start(XFER_HASH, len);
+	while (pos < end) {
+		want = CHECKSUM_CHUNK;
+		if (end - pos < want)
+			want = ((end - pos) + CHECKSUM_ALIGN - 1) &
+				~(uint64_t)(CHECKSUM_ALIGN - 1);
+		for (got = 0; got < want; got += r) {
+			/* A short read can leave us off the alignment O_DIRECT
+			 * needs; finish through the page cache from there */
+			rfd = fd;
+			if (direct && (got % CHECKSUM_ALIGN ||
+						(pos + got) % CHECKSUM_ALIGN)) {
+				if (bfd < 0)
+					bfd = open(vol->blk_device, O_RDONLY);
+				if (bfd < 0) {
+					pr_perror("open");
+					goto out;
+				}
+				rfd = bfd;
+			}
+			r = pread64(rfd, buf + got, want - got, pos + got);
+			if (r < 0 && errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			if (r < 0) {
+				pr_perror("pread");
+				goto out;
+			}
+			if (!r)
+				break;
+		}
+		avail = got < end - pos ? got : end - pos;
+		if (avail <= skip) {
+			pr_error("unexpected EOF at offset %" PRIu64 "\n", pos);
+			goto out;
+		}
+		crc = checksum_crc32(crc, buf + skip, avail - skip);
+		crcc = checksum_crc32c(crcc, buf + skip, avail - skip);
+		xxh64_update(&xxh, buf + skip, avail - skip);
+		done += avail - skip;
+		xfer_add(XFER_HASH, avail - skip, 0);
+		pos += got;
+		skip = 0;
+		mui_set_progress((float)done / (float)len);
+	}
 
-	report_hash(ptn, hash);
+	fastboot_report("target: /%s", ptn);
+	fastboot_report("range: %" PRIu64 "+%" PRIu64, offset, len);
+	fastboot_report("crc32: %08x", crc);
+	fastboot_report("crc32c: %08x", crcc);
+	fastboot_report("xxh64: %016" PRIx64, xxh64_final(&xxh));
 	ret = 0;
+out:
+	xfer_finish(XFER_HASH);
+	mui_reset_progress();
+	free(buf);
+	if (bfd >= 0)
+		close(bfd);
+	close(fd);
+	return ret;
+}
+
+#define VERITY_BLOCK_SIZE	4096
+#define VERITY_MAX_SALT		256
+#define VERITY_MAX_LEVELS	32
+#define VERITY_MAX_THREADS	8
+
+/* Each batch hashes enough input blocks to fill exactly one block of the
+ * level above, so every worker compares whole on-disk hash blocks */
+#define VERITY_BATCH_BLOCKS	(VERITY_BLOCK_SIZE / SHA256_DIGEST_LENGTH)
+
+struct verity_metadata_header {
+	uint32_t magic;
+	uint32_t protocol_version;
+	unsigned char signature[RSANUMBYTES];
+	uint32_t table_length;
+} __attribute__((packed));
+
+struct verity_info {
+	uint64_t data_blocks;
+	uint64_t tree_offset;
+	unsigned char root[SHA256_DIGEST_LENGTH];
+	unsigned char salt[VERITY_MAX_SALT];
+	size_t salt_len;
+};
+
+struct verity_level_job {
+	int fd;
+	const struct digest_alg *alg;
+	const struct verity_info *vi;
+	uint64_t in_offset;	/* blocks being hashed */
+	uint64_t in_blocks;
+	uint64_t out_offset;	/* on-disk hashes of those blocks */
+	uint64_t next_batch;
+	uint64_t first_bad;	/* lowest mismatching input block */
+	uint64_t *progress;
+	uint64_t total;
+	bool error;
+	char *errmsg;		/* first worker failure, reported after join */
+	pthread_mutex_t lock;
+};
+
+static int hex_to_bin(const char *hex, unsigned char *out, size_t max)
+{
+	size_t len = strlen(hex);
+	size_t i;
+
+	if (len % 2 || len / 2 > max)
+		return -1;
+
+	for (i = 0; i < len / 2; i++) {
+		unsigned int byte;
+
+		if (!isxdigit(hex[i * 2]) || !isxdigit(hex[i * 2 + 1]) ||
+				sscanf(hex + i * 2, "%2x", &byte) != 1)
+			return -1;
+		out[i] = byte;
+	}
+	return len / 2;
+}
+
+/* Parse the dm-verity table stored in the metadata block that follows the
+ * filesystem:
+ * 1 <data dev> <hash dev> <data bs> <hash bs> <data blocks> <hash start>
+ *   sha256 <root digest> <salt>
+ * The table signature is not checked here. */
+static int read_verity_info(int fd, uint64_t data_len, struct verity_info *vi)
+{
+	struct verity_metadata_header *hdr;
+	char *buf, *table, *saveptr;
+	char *fields[10];
+	int nfields;
+	int salt_len;
+	int ret = -1;
+
+	buf = xmalloc(VERITY_METADATA_SIZE + 1);
+	if (pread_full(fd, buf, VERITY_METADATA_SIZE, data_len))
+		goto out;
+
+	hdr = (struct verity_metadata_header *)buf;
+	if (hdr->magic != VERITY_METADATA_MAGIC_NUMBER) {
+		pr_error("verity magic not found\n");
+		goto out;
+	}
+
+	if (hdr->protocol_version != 0) {
+		pr_error("Unsupported verity protocol version %u\n",
+				hdr->protocol_version);
+		goto out;
+	}
+
+	if (hdr->table_length > VERITY_METADATA_SIZE - sizeof(*hdr)) {
+		pr_error("bad verity table length %u\n", hdr->table_length);
+		goto out;
+	}
+	table = buf + sizeof(*hdr);
+	table[hdr->table_length] = '\0';
+	pr_debug("verity table: %s\n", table);
+
+	for (nfields = 0; nfields < 10; nfields++) {
+		fields[nfields] = strtok_r(nfields ? NULL : table, " \n",
+				&saveptr);
+		if (!fields[nfields])
+			break;
+	}
+	if (nfields != 10) {
+		pr_error("malformed verity table\n");
+		goto out;
+	}
+
+	if (strcmp(fields[0], "1") || strcmp(fields[3], "4096") ||
+			strcmp(fields[4], "4096") ||
+			strcmp(fields[7], "sha256")) {
+		pr_error("unsupported verity table parameters\n");
+		goto out;
+	}
+
+	vi->data_blocks = strtoull(fields[5], NULL, 10);
+	vi->tree_offset = strtoull(fields[6], NULL, 10) * VERITY_BLOCK_SIZE;
+	if (!vi->data_blocks || !vi->tree_offset) {
+		pr_error("bad verity data or hash offsets\n");
+		goto out;
+	}
+
+	if (hex_to_bin(fields[8], vi->root, sizeof(vi->root)) !=
+			SHA256_DIGEST_LENGTH) {
+		pr_error("bad verity root digest\n");
+		goto out;
+	}
+
+	salt_len = hex_to_bin(fields[9], vi->salt, sizeof(vi->salt));
+	if (salt_len < 0) {
+		pr_error("bad verity salt\n");
+		goto out;
+	}
+	vi->salt_len = salt_len;
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+static void verity_hash_block(const struct digest_alg *alg,
+		const struct verity_info *vi, const unsigned char *block,
+		unsigned char *out)
+{
+	struct digest_ctx ctx;
+
+	digest_init(&ctx, alg);
+	digest_update(&ctx, vi->salt, vi->salt_len);
+	digest_update(&ctx, block, VERITY_BLOCK_SIZE);
+	digest_final(&ctx, out);
+}
+
+static void *verity_level_thread(void *data)
+{
+	struct verity_level_job *job = data;
+	unsigned char *in, *expected, *computed;
+
+	in = xmalloc(VERITY_BATCH_BLOCKS * VERITY_BLOCK_SIZE);
+	expected = xmalloc(VERITY_BLOCK_SIZE);
+	computed = xmalloc(VERITY_BLOCK_SIZE);
+
+	for (;;) {
+		uint64_t batch, first, count, i;
+		bool stop;
+
+		pthread_mutex_lock(&job->lock);
+		batch = job->next_batch++;
+		stop = job->error;
+		pthread_mutex_unlock(&job->lock);
+
+		first = batch * VERITY_BATCH_BLOCKS;
+		if (stop || first >= job->in_blocks)
+			break;
+		count = min((uint64_t)VERITY_BATCH_BLOCKS,
+				job->in_blocks - first);
+
+		if (pread_full(job->fd, in, count * VERITY_BLOCK_SIZE,
+					job->in_offset + first * VERITY_BLOCK_SIZE) ||
+				pread_full(job->fd, expected, VERITY_BLOCK_SIZE,
+					job->out_offset + batch * VERITY_BLOCK_SIZE)) {
+			/* INFO lines from this thread never reach the host,
+			 * verity_check_level() reports it after the join */
+			pthread_mutex_lock(&job->lock);
+			job->error = true;
+			if (!job->errmsg)
+				job->errmsg = xasprintf("couldn't read %" PRIu64
+						" blocks at offset 0x%" PRIx64
+						" or their hashes\n", count,
+						job->in_offset + first *
+						VERITY_BLOCK_SIZE);
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+
+		/* Unused trailing entries in a hash block are zero */
+		memset(computed, 0, VERITY_BLOCK_SIZE);
+		for (i = 0; i < count; i++)
+			verity_hash_block(job->alg, job->vi,
+					in + i * VERITY_BLOCK_SIZE,
+					computed + i * SHA256_DIGEST_LENGTH);
+
+		for (i = 0; i < count; i++)
+			if (memcmp(computed + i * SHA256_DIGEST_LENGTH,
+						expected + i * SHA256_DIGEST_LENGTH,
+						SHA256_DIGEST_LENGTH))
+				break;
+
+		pthread_mutex_lock(&job->lock);
+		if (i < count && first + i < job->first_bad)
+			job->first_bad = first + i;
+		*job->progress += count;
+		mui_set_progress((float)*job->progress / (float)job->total);
+		pthread_mutex_unlock(&job->lock);
+		xfer_add(XFER_HASH, (uint64_t)count * VERITY_BLOCK_SIZE, 0);
+	}
+
+	free(in);
+	free(expected);
+	free(computed);
+	return NULL;
+}
+
+/* Hash in_blocks blocks at in_offset on several threads and compare the
+ * results against the hash blocks stored at out_offset. Returns the index
+ * of the first mismatching input block in *first_bad, or UINT64_MAX. */
+static int verity_check_level(int fd, const struct digest_alg *alg,
+		const struct verity_info *vi, uint64_t in_offset,
+		uint64_t in_blocks, uint64_t out_offset, uint64_t *progress,
+		uint64_t total, uint64_t *first_bad)
+{
+	struct verity_level_job job;
+	pthread_t threads[VERITY_MAX_THREADS];
+	uint64_t batches;
+	long ncpus;
+	int nthreads, started, i;
+
+	memset(&job, 0, sizeof(job));
+	job.fd = fd;
+	job.alg = alg;
+	job.vi = vi;
+	job.in_offset = in_offset;
+	job.in_blocks = in_blocks;
+	job.out_offset = out_offset;
+	job.first_bad = UINT64_MAX;
+	job.progress = progress;
+	job.total = total;
+	pthread_mutex_init(&job.lock, NULL);
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = (ncpus > 0) ? min(ncpus, (long)VERITY_MAX_THREADS) : 1;
+	batches = div_round_up(in_blocks, VERITY_BATCH_BLOCKS);
+	if ((uint64_t)nthreads > batches)
+		nthreads = batches;
+
+	for (started = 0; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL,
+					verity_level_thread, &job)) {
+			pr_perror("pthread_create");
+			job.error = true;
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	if (job.errmsg) {
+		pr_error("%s", job.errmsg);
+		free(job.errmsg);
+	}
+
+	*first_bad = job.first_bad;
+	return job.error ? -1 : 0;
+}
+
+int verify_ext_image_verity(const char *ptn)
+{
+	const struct digest_alg *alg = digest_alg_by_name("sha256");
+	struct verity_info vi;
+	uint64_t level_blocks[VERITY_MAX_LEVELS];
+	uint64_t level_offset[VERITY_MAX_LEVELS];
+	uint64_t data_len, total, progress, bad;
+	unsigned char top[VERITY_BLOCK_SIZE];
+	unsigned char root[SHA256_DIGEST_LENGTH];
+	int levels = 0;
+	int fd = -1;
+	int ret = -1;
+	int i;
+
+	pr_status("Verifying dm-verity tree of /%s\n", ptn);
+
+	fd = open_partition(ptn);
+	if (fd < 0)
+		goto out;
+
+	pthread_mutex_lock(&ext_info_lock);
+	if (read_ext(fd, 1)) {
+		pthread_mutex_unlock(&ext_info_lock);
+		pr_error("ext image corrupted\n");
+		goto out;
+	}
+	data_len = info.len;
+	pthread_mutex_unlock(&ext_info_lock);
+
+	if (read_verity_info(fd, data_len, &vi))
+		goto out;
+
+	if (vi.data_blocks * VERITY_BLOCK_SIZE != data_len)
+		pr_info("verity covers %" PRIu64 " blocks, filesystem has %"
+				PRIu64 "\n", vi.data_blocks,
+				data_len / VERITY_BLOCK_SIZE);
+
+	/* The tree is stored top level first, data hashes last */
+	do {
+		if (levels == VERITY_MAX_LEVELS) {
+			pr_error("verity tree too deep\n");
+			goto out;
+		}
+		level_blocks[levels] = verity_tree_blocks(vi.data_blocks *
+				VERITY_BLOCK_SIZE, VERITY_BLOCK_SIZE,
+				SHA256_DIGEST_LENGTH, levels);
+		levels++;
+	} while (level_blocks[levels - 1] > 1);
+
+	level_offset[levels - 1] = vi.tree_offset;
+	for (i = levels - 2; i >= 0; i--)
+		level_offset[i] = level_offset[i + 1] +
+			level_blocks[i + 1] * VERITY_BLOCK_SIZE;
+
+	total = vi.data_blocks;
+	for (i = 0; i < levels - 1; i++)
+		total += level_blocks[i];
+	progress = 0;
+	mui_show_progress(1.0, 0);
+	xfer_start(XFER_HASH, total * VERITY_BLOCK_SIZE);
+
+	ret = 0;
+	for (i = 0; i < levels; i++) {
+		uint64_t in_offset = i ? level_offset[i - 1] : 0;
+		uint64_t in_blocks = i ? level_blocks[i - 1] : vi.data_blocks;
+
+		if (verity_check_level(fd, alg, &vi, in_offset, in_blocks,
+					level_offset[i], &progress, total,
+					&bad)) {
+			ret = -1;
+			goto out_progress;
+		}
+
+		if (bad == UINT64_MAX)
+			continue;
+
+		ret = -1;
+		if (i == 0)
+			pr_error("data block %" PRIu64 " (offset 0x%" PRIx64
+					") is corrupt\n", bad,
+					bad * VERITY_BLOCK_SIZE);
+		else
+			pr_error("hash tree level %d block %" PRIu64
+					" doesn't match its hash\n", i - 1, bad);
+	}
+
+	if (pread_full(fd, top, VERITY_BLOCK_SIZE, vi.tree_offset)) {
+		ret = -1;
+		goto out_progress;
+	}
+	verity_hash_block(alg, &vi, top, root);
+	if (memcmp(root, vi.root, SHA256_DIGEST_LENGTH)) {
+		pr_error("verity root hash mismatch\n");
+		ret = -1;
+	}
+
+	if (!ret)
+		pr_info("/%s: %" PRIu64 " blocks verified, %d tree levels\n",
+				ptn, vi.data_blocks, levels);
+out_progress:
+	xfer_finish(XFER_HASH);
+	mui_reset_progress();
 out:
 	if (fd >= 0)
 		close(fd);
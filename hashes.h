@@ -33,8 +33,20 @@
 #ifndef _HASHES_H_
 #define _HASHES_H_
 
-int get_fat_file_hashes(const char *ptn);
-int get_boot_image_hash(const char *ptn);
-int get_ext_image_hash(const char *ptn);
+#include "digest.h"
+
+/* Report hashes for each partition, in order. FAT partitions get one
+ * hash per file, ext4 and boot images cover just the image, anything
+ * else is hashed in full. */
+int get_partition_hashes(char **ptns, int count, const struct digest_alg *alg);
+int verify_ext_image_verity(const char *ptn);
+
+/* Report CRC32, CRC32C and XXH64 of len bytes of a partition starting
+ * at offset, read with direct I/O. len 0 means to the end. */
+int checksum_partition(const char *ptn, uint64_t offset, uint64_t len);
+
+/* Drop cached digests for a partition that is about to be or has been
+ * written. NULL invalidates everything, e.g. after repartitioning. */
+void hash_cache_invalidate(const char *ptn);
 
 #endif
@@ -3,7 +3,7 @@ LOCAL_PATH := $(call my-dir)
 # Static version for recovery console plug-ins;
 # we'll want to emit debugs to stdout instead of liblog
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := gpt.c
+LOCAL_SRC_FILES := gpt.c checksum.c
 LOCAL_MODULE := libgpt_static
 LOCAL_MODULE_TAGS := optional
 LOCAL_CFLAGS := -Wall -Werror -DDEBUG_STDOUT=1
@@ -14,7 +14,7 @@ LOCAL_STATIC_LIBRARIES := libz libcutils
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := gpt.c
+LOCAL_SRC_FILES := gpt.c checksum.c
 LOCAL_MODULE := libgpt
 LOCAL_MODULE_TAGS := optional
 LOCAL_CFLAGS := -Wall -Werror
@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <zlib.h>
+#include <gpt/checksum.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86_CRC
+#endif
+
+/* ARMv8 CRC instructions are only used when the toolchain targets them */
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_ARM_CRC
+#endif
+
+#define CRC32C_POLY	0x82f63b78	/* reversed Castagnoli */
+
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[256];
+static bool have_pclmul;
+static bool have_sse42;
+
+static void checksum_setup(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc32c_table[i] = crc;
+	}
+
+#ifdef HAVE_X86_CRC
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+			have_sse42 = (ecx & bit_SSE4_2) != 0;
+			have_pclmul = have_sse42 && (ecx & bit_PCLMUL) != 0;
+		}
+	}
+#endif
+}
+
+#ifdef HAVE_X86_CRC
+
+/* Fold 64 bytes at a time with carry-less multiplies, as described in
+ * Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction". len must be at least 64 and a multiple of 16, crc is
+ * passed and returned inverted. */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32_pclmul(const unsigned char *buf, size_t len, uint32_t crc)
+{
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+		{ 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+		{ 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+		{ 0x0163cd6124ULL, 0x0000000000ULL };
+	static const uint64_t poly[2] __attribute__((aligned(16))) =
+		{ 0x01db710641ULL, 0x01f7011641ULL };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				_mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				_mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				_mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				_mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 bits down to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+#ifdef __x86_64__
+	{
+		uint64_t crc64 = crc;
+		uint64_t val;
+
+		for (; len >= 8; p += 8, len -= 8) {
+			memcpy(&val, p, 8);
+			crc64 = _mm_crc32_u64(crc64, val);
+		}
+		crc = crc64;
+	}
+#else
+	{
+		uint32_t val;
+
+		for (; len >= 4; p += 4, len -= 4) {
+			memcpy(&val, p, 4);
+			crc = _mm_crc32_u32(crc, val);
+		}
+	}
+#endif
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+#endif /* HAVE_X86_CRC */
+
+uint32_t checksum_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	pthread_once(&checksum_once, checksum_setup);
+
+#ifdef HAVE_ARM_CRC
+	crc = ~crc;
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t val;
+
+		memcpy(&val, p, 8);
+		crc = __crc32d(crc, val);
+	}
+	while (len--)
+		crc = __crc32b(crc, *p++);
+	return ~crc;
+#else
+	size_t chunk;
+
+#ifdef HAVE_X86_CRC
+	if (have_pclmul && len >= 64) {
+		chunk = len & ~(size_t)15;
+		crc = ~crc32_pclmul(p, chunk, ~crc);
+		p += chunk;
+		len -= chunk;
+	}
+#endif
+	/* zlib takes an unsigned int length */
+	while (len) {
+		chunk = len > (1U << 30) ? (1U << 30) : len;
+		crc = crc32(crc, p, chunk);
+		p += chunk;
+		len -= chunk;
+	}
+	return crc;
+#endif
+}
+
+uint32_t checksum_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	pthread_once(&checksum_once, checksum_setup);
+	crc = ~crc;
+
+#if defined(HAVE_ARM_CRC)
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t val;
+
+		memcpy(&val, p, 8);
+		crc = __crc32cd(crc, val);
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+#else
+#ifdef HAVE_X86_CRC
+	if (have_sse42)
+		return ~crc32c_sse42(crc, p, len);
+#endif
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+#endif
+	return ~crc;
+}
+
+#define XXH_PRIME64_1	11400714785074694791ULL
+#define XXH_PRIME64_2	14029467366897019727ULL
+#define XXH_PRIME64_3	1609587929392839161ULL
+#define XXH_PRIME64_4	9650029242287828579ULL
+#define XXH_PRIME64_5	2870177450012600261ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t val;
+
+	memcpy(&val, p, 8);
+	return le64toh(val);
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, 4);
+	return le32toh(val);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh64_stripe(struct xxh64_state *st, const unsigned char *p)
+{
+	st->v[0] = xxh64_round(st->v[0], read64(p));
+	st->v[1] = xxh64_round(st->v[1], read64(p + 8));
+	st->v[2] = xxh64_round(st->v[2], read64(p + 16));
+	st->v[3] = xxh64_round(st->v[3], read64(p + 24));
+}
+
+void xxh64_init(struct xxh64_state *st, uint64_t seed)
+{
+	memset(st, 0, sizeof(*st));
+	st->seed = seed;
+	st->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	st->v[1] = seed + XXH_PRIME64_2;
+	st->v[2] = seed;
+	st->v[3] = seed - XXH_PRIME64_1;
+}
+
+void xxh64_update(struct xxh64_state *st, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t fill;
+
+	st->total += len;
+
+	if (st->buf_len) {
+		fill = sizeof(st->buf) - st->buf_len;
+		if (fill > len)
+			fill = len;
+		memcpy(st->buf + st->buf_len, p, fill);
+		st->buf_len += fill;
+		p += fill;
+		len -= fill;
+		if (st->buf_len < sizeof(st->buf))
+			return;
+		xxh64_stripe(st, st->buf);
+		st->buf_len = 0;
+	}
+
+	for (; len >= 32; p += 32, len -= 32)
+		xxh64_stripe(st, p);
+
+	memcpy(st->buf, p, len);
+	st->buf_len = len;
+}
+
+uint64_t xxh64_final(struct xxh64_state *st)
+{
+	const unsigned char *p = st->buf;
+	size_t len = st->buf_len;
+	uint64_t h;
+
+	if (st->total >= 32) {
+		h = rotl64(st->v[0], 1) + rotl64(st->v[1], 7) +
+			rotl64(st->v[2], 12) + rotl64(st->v[3], 18);
+		h = xxh64_merge(h, st->v[0]);
+		h = xxh64_merge(h, st->v[1]);
+		h = xxh64_merge(h, st->v[2]);
+		h = xxh64_merge(h, st->v[3]);
+	} else {
+		h = st->seed + XXH_PRIME64_5;
+	}
+	h += st->total;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	while (len--) {
+		h ^= *p++ * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
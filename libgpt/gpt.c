@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <inttypes.h>
 
 #if DEBUG_STDOUT
@@ -40,8 +41,8 @@
 #include <cutils/log.h>
 #endif
 
-#include <zlib.h>
 #include <gpt/gpt.h>
+#include <gpt/checksum.h>
 
 #define pr_perror(x, ...) pr_error(x ": %s\n", ##__VA_ARGS__, strerror(errno));
 
@@ -223,24 +224,6 @@ static ssize_t robust_read(int fd, void *buf, size_t count, bool short_ok)
 }
 
 
-static ssize_t robust_write(int fd, void *buf, size_t count)
-{
-	int ret;
-	size_t bytes_written = 0;
-
-	while (count) {
-		ret = write(fd, buf, count);
-		if (ret <= 0 && errno != EINTR) {
-			pr_perror("write");
-			return -1;
-		}
-		count -= ret;
-		bytes_written += ret;
-	}
-	return bytes_written;
-}
-
-
 int gpt_sync_ptable(const char *device)
 {
 	int fd;
@@ -524,8 +507,7 @@ int gpt_new(struct gpt *gpt)
  * Returned checksum is byte-swapped */
 static uint32_t get_entries_crc32(struct gpt *gpt)
 {
-	uint32_t crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, (void *)gpt->entries,
+	uint32_t crc = checksum_crc32(0, gpt->entries,
 			gpt->header.num_pentries * gpt->header.pentry_size);
 	return htole32(crc);
 }
@@ -540,8 +522,7 @@ static uint32_t get_header_crc32(struct gpt *gpt)
 
 	old_crc = gpt->header.crc32;
 	gpt->header.crc32 = 0;
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, (void*)&gpt->header, letoh32(gpt->header.header_size));
+	crc = checksum_crc32(0, &gpt->header, letoh32(gpt->header.header_size));
 	gpt->header.crc32 = old_crc;
 	return htole32(crc);
 }
@@ -578,145 +559,150 @@ struct gpt *gpt_copy(struct gpt *src)
 }
 
 
-static int write_gpt_to_disk(struct gpt *gpt)
+static int robust_pwritev(int fd, struct iovec *iov, int iovcnt,
+		uint64_t offset)
 {
-	int fd;
-	uint64_t header_offset, entries_offset, entries_size;
-
-	/* Stash some data before we swap back to little-endian */
-	entries_size = gpt->header.num_pentries * gpt->header.pentry_size;
-	header_offset = gpt->header.current_lba * gpt->lba_size;
-	entries_offset = gpt->header.pentry_start_lba * gpt->lba_size;
-
-	/* byteswap and compute checksums */
-	gpt_entries_bytes_to_le(gpt);
-	gpt->header.pentry_crc32 = get_entries_crc32(gpt);
-	gpt_header_bytes_to_le(gpt);
-	gpt->header.crc32 = get_header_crc32(gpt);
-
-	fd = open(gpt->device, O_WRONLY);
-	if (fd < 0) {
-		pr_perror("open");
-		return -1;
-	}
-
-	if (lseek64(fd, header_offset, SEEK_SET) == -1) {
-		pr_perror("lseek64");
-		goto out_fd;
-	}
-
-	if (robust_write(fd, &gpt->header, sizeof(struct gpt_header)) < 0) {
-		pr_error("couldn't write GPT header\n");
-		goto out_fd;
-	}
-
-	if (lseek64(fd, entries_offset, SEEK_SET) == -1) {
-		pr_perror("lseek64\n");
-		goto out_fd;
-	}
+	ssize_t ret;
 
-	if (robust_write(fd, gpt->entries, entries_size) < 0) {
-		pr_error("Couldn't write GPT entries array\n");
-		goto out_fd;
-	}
+	while (iovcnt) {
+		ret = pwritev64(fd, iov, iovcnt, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("pwritev");
+			return -1;
+		}
+		offset += ret;
 
-	if (close(fd)) {
-		pr_perror("close");
-		return -1;
+		/* Skip past whatever made it out on a short write */
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
 	}
-
 	return 0;
-out_fd:
-	close(fd);
-	return -1;
 }
 
 
-static int write_mbr(const char *device, struct mbr *mbr)
+/* Fill in a whole header sector for one copy of the GPT. le->entries
+ * must already be little-endian, le->header is in host order and is
+ * left byteswapped. */
+static void build_header_block(struct gpt *le, struct gpt *gpt,
+		unsigned char *block, uint64_t current_lba, uint64_t backup_lba,
+		uint64_t pentry_start_lba, uint32_t pentry_crc32)
 {
-	int fd;
-
-	fd = open(device, O_WRONLY);
-	if (fd < 0) {
-		pr_perror("open");
-		return -1;
-	}
-
-	if (lseek64(fd, 440, SEEK_SET) == -1) {
-		pr_perror("lseek64");
-		goto out_fd;
-	}
-
-	if (robust_write(fd, mbr, sizeof(struct mbr)) < 0) {
-		pr_error("Couldn't write MBR\n");
-		goto out_fd;
-	}
-
-	if (close(fd)) {
-		pr_perror("close");
-		return -1;
-	}
-
-	return 0;
-out_fd:
-	close(fd);
-	return -1;
+	le->header = gpt->header;
+	le->header.current_lba = current_lba;
+	le->header.backup_lba = backup_lba;
+	le->header.pentry_start_lba = pentry_start_lba;
+	le->header.pentry_crc32 = pentry_crc32;
+	gpt_header_bytes_to_le(le);
+	le->header.crc32 = get_header_crc32(le);
+
+	/* Rest of the header sector is reserved and must be zero */
+	memset(block, 0, gpt->lba_size);
+	memcpy(block, &le->header, sizeof(struct gpt_header));
 }
 
 
+/* Both copies share one little-endian entries array, so everything is
+ * built in a single buffer and written through one fd. The backup is
+ * written and flushed before the primary, so a power cut at any point
+ * leaves at least one intact copy for the firmware to fall back on. */
 int gpt_write(struct gpt *gpt)
 {
-	struct gpt *le_gpt;
-	int ret;
+	struct gpt le;
 	struct mbr mbr;
-	uint64_t entries_size;
+	struct iovec iov[2];
+	unsigned char *buf;
+	unsigned char *entries, *primary, *backup;
+	uint64_t entries_size, entries_lbas, backup_entries_lba;
+	uint32_t pentry_crc32;
+	int fd;
+	int ret = -1;
 
 	entries_size = gpt->header.num_pentries * gpt->header.pentry_size;
+	entries_lbas = entries_size / gpt->lba_size;
+	backup_entries_lba = gpt->sectors - 1 - entries_lbas;
 
-	/* Write primary GPT */
-	le_gpt = gpt_copy(gpt);
-	if (!le_gpt) {
-		pr_error("Failed to copy GPT\n");
-		return -1;
-	}
-	le_gpt->header.current_lba = 1;
-	le_gpt->header.backup_lba = le_gpt->sectors - 1;
-	le_gpt->header.pentry_start_lba = 2;
-	ret = write_gpt_to_disk(le_gpt);
-	gpt_close(le_gpt);
-	if (ret) {
-		pr_error("Failed to write primary GPT\n");
+	buf = malloc(entries_size + 2 * gpt->lba_size);
+	if (!buf) {
+		pr_perror("malloc");
 		return -1;
 	}
+	entries = buf;
+	primary = entries + entries_size;
+	backup = primary + gpt->lba_size;
 
-	/* Write backup GPT */
-	le_gpt = gpt_copy(gpt);
-	if (!le_gpt) {
-		pr_error("Failed to copy GPT\n");
-		return -1;
-	}
-	le_gpt->header.current_lba = le_gpt->sectors - 1;
-	le_gpt->header.backup_lba = 1;
-	le_gpt->header.pentry_start_lba = le_gpt->header.current_lba -
-		(entries_size / le_gpt->lba_size);
-	ret = write_gpt_to_disk(le_gpt);
-	gpt_close(le_gpt);
-	if (ret) {
-		pr_error("Failed to write backup GPT\n");
-		return -1;
-	}
+	memcpy(entries, gpt->entries, entries_size);
+	le = *gpt;
+	le.entries = entries;
+	gpt_entries_bytes_to_le(&le);
+	pentry_crc32 = get_entries_crc32(&le);
+
+	build_header_block(&le, gpt, primary, 1, gpt->sectors - 1, 2,
+			pentry_crc32);
+	build_header_block(&le, gpt, backup, gpt->sectors - 1, 1,
+			backup_entries_lba, pentry_crc32);
 
-	/* Write protective MBR */
 	memset(&mbr, 0, sizeof(mbr));
 	mbr.sig = htole16(0xAA55);
 	mbr.entries[0].type = 0xEE;
 	mbr.entries[0].first_lba = htole32(1);
 	mbr.entries[0].lba_count = htole32(min(gpt->sectors - 1, 0xFFFFFFFFULL));
-	if (write_mbr(gpt->device, &mbr)) {
+
+	fd = open(gpt->device, O_WRONLY);
+	if (fd < 0) {
+		pr_perror("open");
+		goto out;
+	}
+
+	/* Backup entries are immediately followed by the backup header */
+	iov[0].iov_base = entries;
+	iov[0].iov_len = entries_size;
+	iov[1].iov_base = backup;
+	iov[1].iov_len = gpt->lba_size;
+	if (robust_pwritev(fd, iov, 2, backup_entries_lba * gpt->lba_size) ||
+			fsync(fd)) {
+		pr_error("Failed to write backup GPT\n");
+		goto out_fd;
+	}
+
+	iov[0].iov_base = primary;
+	iov[0].iov_len = gpt->lba_size;
+	iov[1].iov_base = entries;
+	iov[1].iov_len = entries_size;
+	if (robust_pwritev(fd, iov, 2, gpt->lba_size)) {
+		pr_error("Failed to write primary GPT\n");
+		goto out_fd;
+	}
+
+	/* Leave the boot code in the first 440 bytes alone */
+	iov[0].iov_base = &mbr;
+	iov[0].iov_len = sizeof(mbr);
+	if (robust_pwritev(fd, iov, 1, 440)) {
 		pr_error("Couldn't write protective MBR\n");
-		return -1;
+		goto out_fd;
 	}
-	return 0;
+
+	if (fsync(fd)) {
+		pr_perror("fsync");
+		goto out_fd;
+	}
+	ret = 0;
+out_fd:
+	if (close(fd) && !ret) {
+		pr_perror("close");
+		ret = -1;
+	}
+out:
+	free(buf);
+	return ret;
 }
 
 
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_GPT_CHECKSUM_H
+#define ANDROID_GPT_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Checksums with CPU acceleration where available. The CRCs work like
+ * zlib's crc32(): start with 0 and feed the previous result back in to
+ * continue a running checksum. */
+
+/* CRC-32 as used by GPT, zip and zlib */
+uint32_t checksum_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* CRC-32C (Castagnoli) */
+uint32_t checksum_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* XXH64, streaming */
+struct xxh64_state {
+	uint64_t v[4];
+	uint64_t total;
+	uint64_t seed;
+	unsigned char buf[32];
+	size_t buf_len;
+};
+
+void xxh64_init(struct xxh64_state *st, uint64_t seed);
+void xxh64_update(struct xxh64_state *st, const void *buf, size_t len);
+uint64_t xxh64_final(struct xxh64_state *st);
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <cutils/klog.h>
+
+#include "logger.h"
+#include "fastboot.h"
+#include "userfastboot_ui.h"
+
+#define LOGGER_TAG		"userfastboot"
+#define LOGGER_MSG_MAX		256
+#define LOGGER_RING_SIZE	512	/* power of two */
+#define LOGGER_FLUSH_MS		500
+
+/* Bounded multi-producer queue: a producer claims a slot by advancing
+ * log_head, fills it in and then publishes it by setting seq to one past
+ * its position. The draining thread is the only consumer. */
+struct log_slot {
+	unsigned int seq;
+	int level;
+	unsigned int flags;
+	char msg[LOGGER_MSG_MAX];
+};
+
+static struct log_slot log_ring[LOGGER_RING_SIZE];
+static unsigned int log_head;
+static unsigned int log_tail;
+static unsigned int log_dropped;
+static int log_level = LOGGER_DEBUG;
+
+static bool log_running;
+static pthread_t log_thread;
+static int log_sleeping;
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake_cond = PTHREAD_COND_INITIALIZER;
+
+static void emit(int level, unsigned int flags, const char *msg)
+{
+	klog_write(level, "<%d>" LOGGER_TAG ": %s", level, msg);
+
+	if (flags & LOGGER_STATUS) {
+		mui_status("%s", msg);
+	} else if (flags & LOGGER_SCREEN) {
+		if (level <= LOGGER_ERROR)
+			mui_print("E: %s", msg);
+		else if (level == LOGGER_WARNING)
+			mui_print("W: %s", msg);
+		else
+			mui_print("%s", msg);
+	}
+}
+
+static bool enqueue(int level, unsigned int flags, const char *msg)
+{
+	struct log_slot *slot;
+	unsigned int pos, seq;
+	int diff;
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &log_ring[pos & (LOGGER_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&log_head, &pos,
+						pos + 1, true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Full, the consumer hasn't freed this slot yet */
+			return false;
+		} else {
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->level = level;
+	slot->flags = flags;
+	strcpy(slot->msg, msg);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+static void wake_logger(void)
+{
+	if (!__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&log_wake_lock);
+	pthread_cond_signal(&log_wake_cond);
+	pthread_mutex_unlock(&log_wake_lock);
+}
+
+void logger_write(int level, unsigned int flags, const char *fmt, ...)
+{
+	char msg[LOGGER_MSG_MAX];
+	bool logged;
+	va_list ap;
+
+	logged = level <= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+	if (!logged && !(flags & LOGGER_HOST))
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	if (flags & LOGGER_HOST)
+		fastboot_info("%s", msg);
+
+	if (!logged)
+		return;
+
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		emit(level, flags, msg);
+		return;
+	}
+
+	if (enqueue(level, flags, msg))
+		wake_logger();
+	else
+		__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+}
+
+/* Take the next message off the ring, if there is one */
+static bool dequeue(struct log_slot *out)
+{
+	struct log_slot *slot;
+	unsigned int seq;
+
+	slot = &log_ring[log_tail & (LOGGER_RING_SIZE - 1)];
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST);
+	if (seq != log_tail + 1)
+		return false;
+
+	out->level = slot->level;
+	out->flags = slot->flags;
+	strcpy(out->msg, slot->msg);
+	__atomic_store_n(&slot->seq, log_tail + LOGGER_RING_SIZE,
+			__ATOMIC_RELEASE);
+	__atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void *logger_thread(void *arg)
+{
+	struct log_slot entry;
+	unsigned int dropped;
+
+	for (;;) {
+		while (dequeue(&entry))
+			emit(entry.level, entry.flags, entry.msg);
+
+		dropped = __atomic_exchange_n(&log_dropped, 0,
+				__ATOMIC_RELAXED);
+		if (dropped) {
+			snprintf(entry.msg, sizeof(entry.msg),
+					"log ring full, dropped %u messages\n",
+					dropped);
+			emit(LOGGER_WARNING, 0, entry.msg);
+		}
+
+		/* Declare we're going to sleep, then look once more so a
+		 * producer that missed the flag can't be missed by us */
+		pthread_mutex_lock(&log_wake_lock);
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&log_ring[log_tail &
+				(LOGGER_RING_SIZE - 1)].seq,
+				__ATOMIC_SEQ_CST) != log_tail + 1)
+			pthread_cond_wait(&log_wake_cond, &log_wake_lock);
+		__atomic_store_n(&log_sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&log_wake_lock);
+	}
+	return NULL;
+}
+
+void logger_start(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < LOGGER_RING_SIZE; i++)
+		log_ring[i].seq = i;
+
+	if (pthread_create(&log_thread, NULL, logger_thread, NULL)) {
+		KLOG_ERROR(LOGGER_TAG, "couldn't start logger thread, "
+				"logging synchronously\n");
+		return;
+	}
+	__atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+}
+
+void logger_flush(void)
+{
+	unsigned int head;
+	int i;
+
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ||
+			pthread_equal(pthread_self(), log_thread))
+		return;
+
+	head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+	for (i = 0; i < LOGGER_FLUSH_MS / 5; i++) {
+		if ((int)(__atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) -
+					head) >= 0)
+			return;
+		wake_logger();
+		usleep(5000);
+	}
+}
+
+void logger_set_level(int level)
+{
+	__atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int logger_get_level(void)
+{
+	return __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
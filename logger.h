@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_LOGGER_H_
+#define _USERFASTBOOT_LOGGER_H_
+
+/* Severities, same numbering as the kernel log */
+#define LOGGER_ERROR	3
+#define LOGGER_WARNING	4
+#define LOGGER_NOTICE	5
+#define LOGGER_INFO	6
+#define LOGGER_DEBUG	7
+
+/* Where a message goes besides the kernel log */
+#define LOGGER_SCREEN	(1 << 0)	/* on-screen log, via mui_print() */
+#define LOGGER_STATUS	(1 << 1)	/* status line, via mui_status() */
+#define LOGGER_HOST	(1 << 2)	/* INFO packet to the fastboot host */
+
+/* Log a message. Host output is sent right away since it belongs to the
+ * command being run; the kernel log and the screen are fed from a ring
+ * buffer by a background thread, so this never waits on a slow console
+ * or a redraw. If the ring is full the message is dropped and counted
+ * rather than blocking. */
+void logger_write(int level, unsigned int flags, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Start the draining thread; until then messages are written directly */
+void logger_start(void);
+
+/* Wait, briefly, for everything logged so far to be written out */
+void logger_flush(void);
+
+/* Messages less severe than level are not written to the kernel log or
+ * the screen */
+void logger_set_level(int level);
+int logger_get_level(void);
+
+#endif
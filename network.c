@@ -10,11 +10,32 @@
 #include <linux/rtnetlink.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
 
 #include "userfastboot_ui.h"
 #include "userfastboot_util.h"
 #include "aboot.h"
 
+/* A burst of address events is handled once it has been quiet this
+ * long, or after NETLINK_MAX_DELAY_MS if it keeps going */
+#define NETLINK_DEBOUNCE_MS	200
+#define NETLINK_MAX_DELAY_MS	1000
+
+/* What the info text shows for each interface with an IPv4 address */
+struct iface_info {
+	char name[IFNAMSIZ];
+	char *ip;
+	char *mac;
+	struct iface_info *next;
+};
+
+static struct iface_info *ifaces;
+static bool ifaces_scanned;
+static pthread_mutex_t ifaces_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int do_network_ioctl(int fd, int request, char *name, struct ifreq *ifr)
 {
 	memset(ifr, 0, sizeof(*ifr));
@@ -48,62 +69,218 @@ static char *get_mac_string(int fd, char *name)
 	return xasprintf("%s", ether_ntoa(ethaddr));
 }
 
-char *get_network_interface_status(void)
+/* Called with ifaces_lock held */
+static void free_ifaces_locked(void)
 {
-	struct ifreq ifaces[16];
+	struct iface_info *i;
+
+	while ((i = ifaces)) {
+		ifaces = i->next;
+		free(i->ip);
+		free(i->mac);
+		free(i);
+	}
+}
+
+/* Called with ifaces_lock held */
+static struct iface_info *add_iface_locked(int fd, const char *name)
+{
+	struct iface_info *i;
+
+	i = xmalloc(sizeof(*i));
+	memset(i, 0, sizeof(*i));
+	strncpy(i->name, name, IFNAMSIZ - 1);
+	i->mac = get_mac_string(fd, i->name);
+	i->next = ifaces;
+	ifaces = i;
+	return i;
+}
+
+/* Called with ifaces_lock held */
+static struct iface_info *find_iface_locked(const char *name)
+{
+	struct iface_info *i;
+
+	for (i = ifaces; i; i = i->next)
+		if (!strcmp(i->name, name))
+			return i;
+	return NULL;
+}
+
+/* Rebuild the table from scratch. Only needed at startup and if we
+ * lost netlink messages; otherwise it's kept current by handle_addr() */
+static void scan_interfaces(void)
+{
+	struct ifreq ifreqs[16];
 	struct ifconf ifconf;
-	int ctr = 0;
 	int fd, i;
-	char *outstr = NULL;
 
 	fd = socket(PF_INET, SOCK_DGRAM, 0);
 	if (fd < 0) {
 		pr_perror("socket");
-		return NULL;
+		return;
 	}
 
-	ifconf.ifc_req = ifaces;
-	ifconf.ifc_len = sizeof(ifaces);
+	ifconf.ifc_req = ifreqs;
+	ifconf.ifc_len = sizeof(ifreqs);
 
 	if (ioctl(fd, SIOCGIFCONF, &ifconf)) {
 		pr_perror("SIOCGIFCONF");
 		close(fd);
-		return NULL;
+		return;
 	}
 
-	outstr = xstrdup("");
+	pthread_mutex_lock(&ifaces_lock);
+	free_ifaces_locked();
+	for (i = 0; i < ifconf.ifc_len / (int)sizeof(struct ifreq); i++) {
+		struct iface_info *iface;
+		char *name = ifreqs[i].ifr_name;
 
-	for (i = 0, ctr = 0; i < ifconf.ifc_len; i += sizeof(struct ifreq), ctr++) {
-		char *name, *ip, *mac, *old_info;
-		struct ifreq *iface = &ifaces[ctr];
+		/* Interfaces with several addresses are listed once
+		 * for each; SIOCGIFADDR gives the primary one */
+		if (!strcmp(name, "lo") || find_iface_locked(name))
+			continue;
 
-		name = iface->ifr_name;
+		iface = add_iface_locked(fd, name);
+		iface->ip = get_ip_string(fd, name);
+	}
+	ifaces_scanned = true;
+	pthread_mutex_unlock(&ifaces_lock);
+	close(fd);
+}
 
-		if (!strcmp(name, "lo"))
-			continue;
+char *get_network_interface_status(void)
+{
+	struct iface_info *i;
+	char *outstr, *old_info;
+	bool scanned;
 
-		ip = get_ip_string(fd, name);
-		mac = get_mac_string(fd, name);
+	pthread_mutex_lock(&ifaces_lock);
+	scanned = ifaces_scanned;
+	pthread_mutex_unlock(&ifaces_lock);
+	if (!scanned)
+		scan_interfaces();
 
+	pthread_mutex_lock(&ifaces_lock);
+	outstr = xstrdup("");
+	for (i = ifaces; i; i = i->next) {
 		old_info = outstr;
-		outstr = xasprintf("%s %s %s\n%s", name, ip, mac, old_info);
-		free(ip);
-		free(mac);
+		outstr = xasprintf("%s%s %s %s\n", old_info, i->name,
+				i->ip, i->mac);
 		free(old_info);
 	}
-	close(fd);
+	pthread_mutex_unlock(&ifaces_lock);
 
 	return outstr;
 }
 
+/* Bring the table up to date for the interface an RTM_NEWADDR or
+ * RTM_DELADDR message is about. The message may concern a secondary
+ * address, so rather than apply it we ask for the interface's address
+ * the way scan_interfaces() does. Returns true if anything we display
+ * changed; DHCP renewals re-announce the address we already have and
+ * don't. */
+static bool handle_addr(struct nlmsghdr *nh)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int rtl = IFA_PAYLOAD(nh);
+	char name[IFNAMSIZ] = "";
+	struct iface_info *iface, **pos;
+	struct ifreq ifr;
+	char *ip = NULL;
+	bool changed = false;
+	int fd, err = 0;
+
+	if (ifa->ifa_family != AF_INET)
+		return false;
+
+	/* Aliases such as eth0:1 have their own label and line */
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, rtl); rta = RTA_NEXT(rta, rtl))
+		if (rta->rta_type == IFA_LABEL)
+			strncpy(name, RTA_DATA(rta), IFNAMSIZ - 1);
+
+	if ((!name[0] && !if_indextoname(ifa->ifa_index, name)) ||
+			!strcmp(name, "lo"))
+		return false;
+
+	fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		pr_perror("socket");
+		return false;
+	}
+
+	if (do_network_ioctl(fd, SIOCGIFADDR, name, &ifr))
+		err = errno;
+	else
+		ip = xstrdup(inet_ntoa(((struct sockaddr_in *)
+						&ifr.ifr_addr)->sin_addr));
+
+	pthread_mutex_lock(&ifaces_lock);
+	iface = find_iface_locked(name);
+	if (ip) {
+		if (!iface)
+			iface = add_iface_locked(fd, name);
+		if (!iface->ip || strcmp(iface->ip, ip)) {
+			pr_debug("%s: address now %s\n", name, ip);
+			free(iface->ip);
+			iface->ip = ip;
+			ip = NULL;
+			changed = true;
+		}
+	} else if (err == EADDRNOTAVAIL) {
+		/* No IPv4 address left on it */
+		if (iface) {
+			pr_debug("%s: address removed\n", name);
+			for (pos = &ifaces; *pos != iface; pos = &(*pos)->next)
+				;
+			*pos = iface->next;
+			free(iface->ip);
+			free(iface->mac);
+			free(iface);
+			changed = true;
+		}
+	} else {
+		pr_error("SIOCGIFADDR %s: %s\n", name, strerror(err));
+	}
+	pthread_mutex_unlock(&ifaces_lock);
+	close(fd);
+	free(ip);
+
+	return changed;
+}
+
+static bool handle_netlink(struct nlmsghdr *nh, int len)
+{
+	bool changed = false;
+
+	for (; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+		switch (nh->nlmsg_type) {
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			changed |= handle_addr(nh);
+			break;
+		case NLMSG_ERROR:
+			pr_error("netlink error message\n");
+			break;
+		}
+	}
+	return changed;
+}
+
 
 void *interface_thread(void *data)
 {
 	int fd;
 	struct sockaddr_nl sa;
+	socklen_t sa_len;
 	ssize_t len;
-	char buf[4096];
-	struct iovec iov = { buf, sizeof(buf) };
+	/* netlink headers must be aligned */
+	char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct pollfd pfd;
+	int64_t burst_start;
+	int timeout, ret;
+	bool changed;
 
 	/* Open up the socket */
 	memset(&sa, 0, sizeof(sa));
@@ -124,20 +301,61 @@ void *interface_thread(void *data)
 
 	/* Initial UI update; the socket is open so we won't miss
 	 * anything */
+	scan_interfaces();
 	populate_status_info();
 
+	pfd.fd = fd;
+	pfd.events = POLLIN;
 	while (1) {
-		struct msghdr msg = { &sa, sizeof(sa), &iov, 1, NULL, 0, 0 };
-		len = recvmsg(fd, &msg, 0);
-		if (len < 0) {
-			pr_perror("recvmsg");
-			goto out;
+		/* Wait for an event, then take in the rest of the burst
+		 * before touching the screen: keep reading until the socket
+		 * has been quiet for NETLINK_DEBOUNCE_MS, but don't hold
+		 * back for more than NETLINK_MAX_DELAY_MS */
+		changed = false;
+		timeout = -1;
+		burst_start = 0;
+		while (1) {
+			ret = poll(&pfd, 1, timeout);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				pr_perror("poll");
+				goto out;
+			}
+			if (ret == 0)
+				break;
+
+			sa_len = sizeof(sa);
+			len = recvfrom(fd, buf, sizeof(buf), 0,
+					(struct sockaddr *)&sa, &sa_len);
+			if (len < 0 && errno == ENOBUFS) {
+				/* The kernel dropped messages on us */
+				pr_debug("netlink overrun, rescanning\n");
+				scan_interfaces();
+				changed = true;
+			} else if (len < 0 && errno != EINTR) {
+				pr_perror("recvfrom");
+				goto out;
+			} else if (len > 0 && sa.nl_pid == 0) {
+				/* Only believe the kernel */
+				changed |= handle_netlink((struct nlmsghdr *)buf,
+						len);
+			}
+
+			if (!burst_start)
+				burst_start = now_ms();
+			timeout = NETLINK_MAX_DELAY_MS -
+				(now_ms() - burst_start);
+			if (timeout <= 0)
+				break;
+			if (timeout > NETLINK_DEBOUNCE_MS)
+				timeout = NETLINK_DEBOUNCE_MS;
 		}
 
-		/* We don't bother looking at the message, we only listen for
-		 * RTMGRP_IPV4_IPADDR so just repop the status */
-		pr_debug("got netlink event\n");
-		populate_status_info();
+		pr_debug("got netlink events, %s\n",
+				changed ? "updating" : "nothing changed");
+		if (changed)
+			populate_status_info();
 	}
 
 out:
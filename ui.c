@@ -19,6 +19,7 @@
 #include <linux/input.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -81,14 +82,44 @@ static enum ProgressBarType {
 static float gProgressScopeStart = 0, gProgressScopeSize = 0, gProgress = 0;
 static double gProgressScopeTime, gProgressScopeDuration;
 
-// Set to 1 when both graphics pages are the same (except for the progress bar)
-static int gPagesIdentical = 0;
+// Latest progress within the scope, in 1/PROGRESS_SCALE steps. Written
+// without locks by mui_set_progress() from I/O loops; only
+// progress_thread() copies it into gProgress and draws it.
+#define PROGRESS_SCALE	65536
+static unsigned int gProgressValue;
+
+// Set when progress_thread() has something new to draw. It sleeps on
+// gProgressCond while this is clear and nothing is animating.
+static int gProgressPending;
+static pthread_mutex_t gProgressWakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gProgressCond = PTHREAD_COND_INITIALIZER;
+
+// Set by mui_stats() when the stats line changed; progress_thread()
+// paints it, since the callers are I/O loops.
+static int gStatsPending;
+
+// Parts of the screen that need repainting. minui may double buffer, so
+// each page keeps its own set: the page being drawn is gPage, and
+// anything marked must be painted on both before it's forgotten.
+enum {
+	DIRTY_ALL	= 1 << 0,	// mode change, repaint everything
+	DIRTY_INFOTEXT	= 1 << 1,	// info text rows in gDirtyInfoRows
+	DIRTY_STATUS	= 1 << 2,
+	DIRTY_PROGRESS	= 1 << 3,
+	DIRTY_OVERLAY	= 1 << 4,	// installing animation frame
+	DIRTY_TEXT	= 1 << 5,	// log rows in gDirtyRows
+	DIRTY_STATS	= 1 << 6,	// transfer stats under the status line
+};
+static unsigned int gDirty[2];
+static uint64_t gDirtyRows[2];
+static uint64_t gDirtyInfoRows[2];
+static int gPage = 0;
 
 static char text[MAX_ROWS][MAX_COLS];
 static char status[MAX_COLS];
+static char stats[MAX_COLS];
 static char infotext[MAX_ROWS][MAX_COLS];
 static int info_row = 0;
-static int status_modified = 0;
 static int text_cols = 0, text_rows = 0;
 static int text_col = 0, text_row = 0, text_top = 0;
 static int show_text = 0;
@@ -129,23 +160,91 @@ static void draw_install_overlay_locked(int frame)
 		ui_parameters.install_overlay_offset_y);
 }
 
+// Blit the part of a surface at (x, y) that falls between rows y1 and y2.
+static void blit_band(gr_surface surface, int x, int y, int y1, int y2)
+{
+	int top = y > y1 ? y : y1;
+	int bottom = y + (int)gr_get_height(surface);
+
+	if (bottom > y2)
+		bottom = y2;
+	if (top >= bottom)
+		return;
+	gr_blit(surface, 0, top - y, gr_get_width(surface), bottom - top,
+		x, top);
+}
+
+// Draw the part of the icon and overlay between rows y1 and y2.
+// Should only be called with gUpdateMutex locked.
+static void draw_icon_band_locked(int y1, int y2)
+{
+	if (gCurrentIcon) {
+		gr_surface surface = gBackgroundIcon[gCurrentIcon];
+		int iconX = (gr_fb_width() - gr_get_width(surface)) / 2;
+		int iconY = (gr_fb_height() - gr_get_height(surface)) / 2;
+		blit_band(surface, iconX, iconY, y1, y2);
+		if (gCurrentIcon == BACKGROUND_ICON_INSTALLING &&
+		    gInstallationOverlay != NULL) {
+			blit_band(gInstallationOverlay[gInstallingFrame],
+				  ui_parameters.install_overlay_offset_x,
+				  ui_parameters.install_overlay_offset_y,
+				  y1, y2);
+		}
+	}
+}
+
+// Repaint just the background (icon and overlay) between rows y1 and y2.
+// Should only be called with gUpdateMutex locked.
+static void draw_background_band_locked(int y1, int y2)
+{
+	gr_color(0, 0, 0, 255);
+	gr_fill(0, y1, gr_fb_width(), y2);
+	draw_icon_band_locked(y1, y2);
+}
+
+// Draw the info text in the top-left corner, over whatever was there.
+// Should only be called with gUpdateMutex locked.
+static void draw_infotext_locked(void)
+{
+	int i;
+
+	pthread_mutex_lock(&gTextMutex);
+	gr_color(167, 162, 195, 255);
+	for (i = 0; i < info_row; i++)
+		gr_text(0, CHAR_HEIGHT * i, infotext[i], 0);
+	pthread_mutex_unlock(&gTextMutex);
+}
+
+// Repaint the given rows of info text. The background icon goes on top,
+// as it does in a full redraw.
+// Should only be called with gUpdateMutex locked.
+static void draw_infotext_rows_locked(uint64_t rows)
+{
+	int i;
+
+	pthread_mutex_lock(&gTextMutex);
+	for (i = 0; i < MAX_ROWS; i++) {
+		if (!(rows & (1ULL << i)))
+			continue;
+		gr_color(0, 0, 0, 255);
+		gr_fill(0, i * CHAR_HEIGHT, gr_fb_width(),
+			(i + 1) * CHAR_HEIGHT);
+		gr_color(167, 162, 195, 255);
+		gr_text(0, CHAR_HEIGHT * i, infotext[i], 0);
+		draw_icon_band_locked(i * CHAR_HEIGHT, (i + 1) * CHAR_HEIGHT);
+	}
+	pthread_mutex_unlock(&gTextMutex);
+}
+
 // Clear the screen and draw the currently selected background icon (if any).
 // Should only be called with gUpdateMutex locked.
 static void draw_background_locked(int icon)
 {
-	int i;
-	gPagesIdentical = 0;
 	gr_color(0, 0, 0, 255);
 	gr_fill(0, 0, gr_fb_width(), gr_fb_height());
-	status_modified = 1;
 
-	if (!show_text && !show_menu) {
-		gr_color(167, 162, 195, 255);
-		pthread_mutex_lock(&gTextMutex);
-		for (i = 0; i <= info_row; i++)
-			gr_text(0, CHAR_HEIGHT * i, infotext[i], 0);
-		pthread_mutex_unlock(&gTextMutex);
-	}
+	if (!show_text && !show_menu)
+		draw_infotext_locked();
 
 	if (icon) {
 		gr_surface surface = gBackgroundIcon[icon];
@@ -160,33 +259,56 @@ static void draw_background_locked(int icon)
 	}
 }
 
-static void draw_status_locked()
+// Top of the status line, just below the progress bar
+static int status_y(void)
 {
 	int iconHeight =
 	    gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
 	int height = gr_get_height(gProgressBarEmpty);
 
+	return CHAR_HEIGHT + height + (3 * gr_fb_height() + iconHeight) / 4;
+}
+
+// Should only be called with gUpdateMutex locked.
+static void draw_status_locked()
+{
 	if (show_text || show_menu)
 		return;
 
 	pthread_mutex_lock(&gTextMutex);
 
-	if (status_modified) {
-		int textwidth = gr_measure(status);
-		int dx = (gr_fb_width() - textwidth) / 2;
-		/* We want the text just below the progress bar */
-		int dy =
-		    CHAR_HEIGHT + height + (3 * gr_fb_height() +
-					    iconHeight) / 4;
+	int textwidth = gr_measure(status);
+	int dx = (gr_fb_width() - textwidth) / 2;
+	int dy = status_y();
 
-		/* Clear any old text in the area */
-		gr_color(0, 0, 0, 255);
-		gr_fill(0, dy - CHAR_HEIGHT, gr_fb_width(), dy + CHAR_HEIGHT);
+	/* Clear any old text in the area */
+	gr_color(0, 0, 0, 255);
+	gr_fill(0, dy - CHAR_HEIGHT, gr_fb_width(), dy + CHAR_HEIGHT);
 
-		gr_color(187, 221, 230, 255);
-		gr_text(dx, dy, status, 1);
-		status_modified = 0;
-	}
+	gr_color(187, 221, 230, 255);
+	gr_text(dx, dy, status, 1);
+
+	pthread_mutex_unlock(&gTextMutex);
+}
+
+// Transfer stats go on the line below the status.
+// Should only be called with gUpdateMutex locked.
+static void draw_stats_locked()
+{
+	if (show_text || show_menu)
+		return;
+
+	pthread_mutex_lock(&gTextMutex);
+
+	int textwidth = gr_measure(stats);
+	int dx = (gr_fb_width() - textwidth) / 2;
+	int dy = status_y() + CHAR_HEIGHT;
+
+	gr_color(0, 0, 0, 255);
+	gr_fill(0, dy, gr_fb_width(), dy + CHAR_HEIGHT);
+
+	gr_color(150, 170, 175, 255);
+	gr_text(dx, dy, stats, 0);
 
 	pthread_mutex_unlock(&gTextMutex);
 }
@@ -195,49 +317,42 @@ static void draw_status_locked()
 // Should only be called with gUpdateMutex locked.
 static void draw_progress_locked()
 {
-	draw_status_locked();
-
-	if (gCurrentIcon == BACKGROUND_ICON_INSTALLING) {
-		draw_install_overlay_locked(gInstallingFrame);
-	}
+	int iconHeight =
+	    gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
+	int width = gr_get_width(gProgressBarEmpty);
+	int height = gr_get_height(gProgressBarEmpty);
 
-	if (gProgressBarType != PROGRESSBAR_TYPE_NONE) {
-		int iconHeight =
-		    gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
-		int width = gr_get_width(gProgressBarEmpty);
-		int height = gr_get_height(gProgressBarEmpty);
+	int dx = (gr_fb_width() - width) / 2;
+	int dy = (3 * gr_fb_height() + iconHeight - 2 * height) / 4;
 
-		int dx = (gr_fb_width() - width) / 2;
-		int dy = (3 * gr_fb_height() + iconHeight - 2 * height) / 4;
+	// Erase behind the progress bar (in case this was a progress-only
+	// update, or the bar has gone away)
+	gr_color(0, 0, 0, 255);
+	gr_fill(dx, dy, dx + width, dy + height);
 
-		// Erase behind the progress bar (in case this was a progress-only update)
-		gr_color(0, 0, 0, 255);
-		gr_fill(dx, dy, width, height);
+	if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL) {
+		float progress =
+		    gProgressScopeStart +
+		    gProgress * gProgressScopeSize;
+		int pos = (int)(progress * width);
 
-		if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL) {
-			float progress =
-			    gProgressScopeStart +
-			    gProgress * gProgressScopeSize;
-			int pos = (int)(progress * width);
-
-			if (pos > 0) {
-				gr_blit(gProgressBarFill, 0, 0, pos, height, dx,
-					dy);
-			}
-			if (pos < width - 1) {
-				gr_blit(gProgressBarEmpty, pos, 0, width - pos,
-					height, dx + pos, dy);
-			}
+		if (pos > 0) {
+			gr_blit(gProgressBarFill, 0, 0, pos, height, dx,
+				dy);
 		}
-
-		if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) {
-			static int frame = 0;
-			gr_blit(gProgressBarIndeterminate[frame], 0, 0, width,
-				height, dx, dy);
-			frame =
-			    (frame + 1) % ui_parameters.indeterminate_frames;
+		if (pos < width - 1) {
+			gr_blit(gProgressBarEmpty, pos, 0, width - pos,
+				height, dx + pos, dy);
 		}
 	}
+
+	if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) {
+		static int frame = 0;
+		gr_blit(gProgressBarIndeterminate[frame], 0, 0, width,
+			height, dx, dy);
+		frame =
+		    (frame + 1) % ui_parameters.indeterminate_frames;
+	}
 }
 
 static void draw_text_line(int row, const char *t)
@@ -286,41 +401,135 @@ static void draw_screen_locked(void)
 		}
 		pthread_mutex_unlock(&gTextMutex);
 	} else {
+		draw_status_locked();
+		draw_stats_locked();
 		draw_progress_locked();
 	}
 }
 
-// Redraw everything on the screen and flip the screen (make it visible).
+// Repaint the given rows of the text log over the dimmed background.
 // Should only be called with gUpdateMutex locked.
-static void update_screen_locked(void)
+static void draw_text_rows_locked(uint64_t rows)
 {
-	draw_screen_locked();
-	gr_flip();
+	int i;
+
+	pthread_mutex_lock(&gTextMutex);
+	for (i = 0; i < text_rows; ++i) {
+		if (!(rows & (1ULL << i)))
+			continue;
+		draw_background_band_locked(i * CHAR_HEIGHT,
+					    (i + 1) * CHAR_HEIGHT);
+		gr_color(0, 0, 0, 160);
+		gr_fill(0, i * CHAR_HEIGHT, gr_fb_width(),
+			(i + 1) * CHAR_HEIGHT);
+		gr_color(255, 255, 255, 255);
+		draw_text_line(i, text[(i + text_top) % text_rows]);
+	}
+	pthread_mutex_unlock(&gTextMutex);
 }
 
-// Updates only the progress bar, if possible, otherwise redraws the screen.
 // Should only be called with gUpdateMutex locked.
-static void update_progress_locked(void)
+static void mark_dirty_locked(unsigned int regions)
 {
-	if (show_text || show_menu)
-		return;
+	gDirty[0] |= regions;
+	gDirty[1] |= regions;
+}
+
+// Should only be called with gUpdateMutex locked.
+static void mark_rows_dirty_locked(uint64_t rows)
+{
+	gDirtyRows[0] |= rows;
+	gDirtyRows[1] |= rows;
+	mark_dirty_locked(DIRTY_TEXT);
+}
+
+// Should only be called with gUpdateMutex locked.
+static void mark_info_rows_dirty_locked(uint64_t rows)
+{
+	gDirtyInfoRows[0] |= rows;
+	gDirtyInfoRows[1] |= rows;
+	mark_dirty_locked(DIRTY_INFOTEXT);
+}
+
+// Repaint what has changed on the page being drawn and flip it on screen.
+// Only a mode change (DIRTY_ALL) redraws the whole screen.
+// Should only be called with gUpdateMutex locked.
+static void flush_screen_locked(void)
+{
+	unsigned int dirty = gDirty[gPage];
+	uint64_t rows = gDirtyRows[gPage];
+	uint64_t info_rows = gDirtyInfoRows[gPage];
+
+	// Whatever isn't visible in the current mode gets painted by the
+	// full redraw when the mode changes
+	if (!(dirty & DIRTY_ALL)) {
+		if (show_menu)
+			dirty = 0;
+		else if (show_text)
+			dirty &= DIRTY_TEXT;
+		else
+			dirty &= ~DIRTY_TEXT;
+		if (!dirty) {
+			gDirty[gPage] = 0;
+			gDirtyRows[gPage] = 0;
+			gDirtyInfoRows[gPage] = 0;
+			return;
+		}
+	}
 
-	if (!gPagesIdentical) {
-		draw_screen_locked();	// Must redraw the whole screen
-		gPagesIdentical = 1;
+	if (dirty & DIRTY_ALL) {
+		draw_screen_locked();
+	} else if (show_text) {
+		draw_text_rows_locked(rows);
 	} else {
-		draw_progress_locked();	// Draw only the progress bar and overlays
+		if (dirty & DIRTY_INFOTEXT)
+			draw_infotext_rows_locked(info_rows);
+		if ((dirty & DIRTY_OVERLAY) &&
+		    gCurrentIcon == BACKGROUND_ICON_INSTALLING)
+			draw_install_overlay_locked(gInstallingFrame);
+		if (dirty & DIRTY_STATUS)
+			draw_status_locked();
+		if (dirty & DIRTY_STATS)
+			draw_stats_locked();
+		if (dirty & DIRTY_PROGRESS)
+			draw_progress_locked();
 	}
+
+	gDirty[gPage] = 0;
+	gDirtyRows[gPage] = 0;
+	gDirtyInfoRows[gPage] = 0;
 	gr_flip();
+	gPage ^= 1;
+}
+
+// Redraw everything on the screen and flip the screen (make it visible).
+// Should only be called with gUpdateMutex locked.
+static void update_screen_locked(void)
+{
+	mark_dirty_locked(DIRTY_ALL);
+	flush_screen_locked();
 }
 
-static void update_status_locked(void)
+// Repaint the given regions and flip the screen.
+// Should only be called with gUpdateMutex locked.
+static void update_regions_locked(unsigned int regions)
 {
-	draw_status_locked();
-	gr_flip();
+	mark_dirty_locked(regions);
+	flush_screen_locked();
 }
 
-// Keeps the progress bar updated, even when the process is otherwise busy.
+// Wake progress_thread() to draw a new frame.
+static void kick_progress_thread(void)
+{
+	pthread_mutex_lock(&gProgressWakeMutex);
+	__atomic_store_n(&gProgressPending, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&gProgressCond);
+	pthread_mutex_unlock(&gProgressWakeMutex);
+}
+
+// Does all the progress bar drawing, at no more than the configured fps,
+// so code reporting progress never waits for the screen. Sleeps until
+// kicked when there is nothing to animate.
 static void *progress_thread(void *cookie)
 {
 	double interval = 1.0 / ui_parameters.update_fps;
@@ -328,7 +537,17 @@ static void *progress_thread(void *cookie)
 		double start = now();
 		pthread_mutex_lock(&gUpdateMutex);
 
-		int redraw = 0;
+		unsigned int redraw = 0;
+		int animating = 0;
+
+		// Anything published from here on gets another frame. This
+		// store and the gProgressValue load below pair with the
+		// opposite order in mui_set_progress(); both sides need
+		// SEQ_CST so at least one of them sees the other.
+		__atomic_store_n(&gProgressPending, 0, __ATOMIC_SEQ_CST);
+
+		if (__atomic_exchange_n(&gStatsPending, 0, __ATOMIC_ACQ_REL))
+			redraw |= DIRTY_STATS;
 
 		// update the installation animation, if active
 		if (gCurrentIcon == BACKGROUND_ICON_INSTALLING &&
@@ -337,30 +556,56 @@ static void *progress_thread(void *cookie)
 			gInstallingFrame =
 			    (gInstallingFrame +
 			     1) % ui_parameters.installing_frames;
-			redraw = 1;
+			redraw |= DIRTY_OVERLAY;
+			animating = 1;
 		}
 		// update the progress bar animation, if active
 		if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE &&
 		    !show_text && !show_menu) {
-			redraw = 1;
+			redraw |= DIRTY_PROGRESS;
+			animating = 1;
 		}
-		// move the progress bar forward on timed intervals, if configured
-		int duration = gProgressScopeDuration;
-		if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
-			double elapsed = now() - gProgressScopeTime;
-			float progress = 1.0 * elapsed / duration;
-			if (progress > 1.0)
-				progress = 1.0;
-			if (progress > gProgress) {
+		if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL) {
+			float progress = (float)__atomic_load_n(&gProgressValue,
+					__ATOMIC_SEQ_CST) / PROGRESS_SCALE;
+
+			// move the progress bar forward on timed intervals, if configured
+			int duration = gProgressScopeDuration;
+			if (duration > 0) {
+				double elapsed = now() - gProgressScopeTime;
+				float timed = 1.0 * elapsed / duration;
+				if (timed > 1.0)
+					timed = 1.0;
+				else
+					animating = 1;
+				if (timed > progress)
+					progress = timed;
+			}
+
+			// Skip updates that aren't visibly different.
+			int width = gr_get_width(gProgressBarIndeterminate[0]);
+			float scale = width * gProgressScopeSize;
+			if (progress > gProgress &&
+			    (int)(gProgress * scale) != (int)(progress * scale)) {
 				gProgress = progress;
-				redraw = 1;
+				redraw |= DIRTY_PROGRESS;
 			}
 		}
 
 		if (redraw)
-			update_progress_locked();
+			update_regions_locked(redraw);
 
 		pthread_mutex_unlock(&gUpdateMutex);
+
+		if (!animating) {
+			pthread_mutex_lock(&gProgressWakeMutex);
+			while (!__atomic_load_n(&gProgressPending,
+						__ATOMIC_ACQUIRE))
+				pthread_cond_wait(&gProgressCond,
+						  &gProgressWakeMutex);
+			pthread_mutex_unlock(&gProgressWakeMutex);
+		}
+
 		double end = now();
 		// minimum of 20ms delay between frames
 		double delay = interval - (end - start);
@@ -532,6 +777,7 @@ void mui_set_background(int icon)
 	gCurrentIcon = icon;
 	update_screen_locked();
 	pthread_mutex_unlock(&gUpdateMutex);
+	kick_progress_thread();
 }
 
 void mui_show_indeterminate_progress()
@@ -542,9 +788,10 @@ void mui_show_indeterminate_progress()
 	pthread_mutex_lock(&gUpdateMutex);
 	if (gProgressBarType != PROGRESSBAR_TYPE_INDETERMINATE) {
 		gProgressBarType = PROGRESSBAR_TYPE_INDETERMINATE;
-		update_progress_locked();
+		update_regions_locked(DIRTY_PROGRESS);
 	}
 	pthread_mutex_unlock(&gUpdateMutex);
+	kick_progress_thread();
 }
 
 void mui_show_progress(float portion, int seconds)
@@ -559,30 +806,39 @@ void mui_show_progress(float portion, int seconds)
 	gProgressScopeTime = now();
 	gProgressScopeDuration = seconds;
 	gProgress = 0;
-	update_progress_locked();
+	__atomic_store_n(&gProgressValue, 0, __ATOMIC_RELAXED);
+	update_regions_locked(DIRTY_PROGRESS);
 	pthread_mutex_unlock(&gUpdateMutex);
+	kick_progress_thread();
 }
 
+// Called from I/O loops for every chunk, so this only publishes the
+// value; progress_thread() decides whether it's worth drawing.
 void mui_set_progress(float fraction)
 {
+	unsigned int value, cur;
+
 	if (!gInit)
 		return;
 
-	pthread_mutex_lock(&gUpdateMutex);
 	if (fraction < 0.0)
 		fraction = 0.0;
 	if (fraction > 1.0)
 		fraction = 1.0;
-	if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
-		// Skip updates that aren't visibly different.
-		int width = gr_get_width(gProgressBarIndeterminate[0]);
-		float scale = width * gProgressScopeSize;
-		if ((int)(gProgress * scale) != (int)(fraction * scale)) {
-			gProgress = fraction;
-			update_progress_locked();
-		}
-	}
-	pthread_mutex_unlock(&gUpdateMutex);
+	value = fraction * PROGRESS_SCALE;
+
+	cur = __atomic_load_n(&gProgressValue, __ATOMIC_RELAXED);
+	do {
+		if (value <= cur)
+			return;
+	} while (!__atomic_compare_exchange_n(&gProgressValue, &cur, value,
+				true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	// Only the first update since the last frame needs to wake it.
+	// SEQ_CST, see progress_thread(): either it reads our value or we
+	// see gProgressPending clear and kick it.
+	if (!__atomic_load_n(&gProgressPending, __ATOMIC_SEQ_CST))
+		kick_progress_thread();
 }
 
 void mui_reset_progress()
@@ -595,7 +851,8 @@ void mui_reset_progress()
 	gProgressScopeStart = gProgressScopeSize = 0;
 	gProgressScopeTime = gProgressScopeDuration = 0;
 	gProgress = 0;
-	update_screen_locked();
+	__atomic_store_n(&gProgressValue, 0, __ATOMIC_RELAXED);
+	update_regions_locked(DIRTY_PROGRESS);
 	pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -630,19 +887,38 @@ void mui_status(const char *fmt, ...)
 	pthread_mutex_lock(&gTextMutex);
 	strncpy(status, buf, sizeof(status));
 	status[sizeof(status) - 1] = '\0';
-	status_modified = 1;
 	pthread_mutex_unlock(&gTextMutex);
 
-	if (!show_text && !show_menu) {
-		pthread_mutex_lock(&gUpdateMutex);
-		update_status_locked();
-		pthread_mutex_unlock(&gUpdateMutex);
+	pthread_mutex_lock(&gUpdateMutex);
+	update_regions_locked(DIRTY_STATUS);
+	pthread_mutex_unlock(&gUpdateMutex);
+}
+
+void mui_stats(const char *line)
+{
+	if (!gInit)
+		return;
+
+	pthread_mutex_lock(&gTextMutex);
+	if (!strncmp(stats, line, sizeof(stats) - 1)) {
+		pthread_mutex_unlock(&gTextMutex);
+		return;
 	}
+	strncpy(stats, line, sizeof(stats));
+	stats[sizeof(stats) - 1] = '\0';
+	pthread_mutex_unlock(&gTextMutex);
+
+	// Painted by progress_thread(), like the progress bar
+	__atomic_store_n(&gStatsPending, 1, __ATOMIC_RELEASE);
+	kick_progress_thread();
 }
 
 void mui_infotext(const char *infodata)
 {
 	char *saveptr, *str, *idata, *token;
+	char row[MAX_COLS];
+	uint64_t changed = 0;
+	int i;
 
 	if (!gInit)
 		return;
@@ -651,23 +927,33 @@ void mui_infotext(const char *infodata)
 	if (!idata)
 		return;
 
+	// Only rows whose text differs get repainted, so callers can
+	// resend the whole block when one line of it changes
 	pthread_mutex_lock(&gTextMutex);
 	info_row = 0;
-	for (str = idata, info_row = 0; info_row < MAX_ROWS;
-	     str = NULL, info_row++) {
-		token = strtok_r(str, "\n", &saveptr);
-		if (!token) {
-			infotext[info_row][0] = '\0';
-			break;
+	for (str = idata, i = 0; i < MAX_ROWS; str = NULL, i++) {
+		token = info_row == i ? strtok_r(str, "\n", &saveptr) : NULL;
+		if (token) {
+			strncpy(row, token, MAX_COLS);
+			row[MAX_COLS - 1] = '\0';
+			info_row = i + 1;
+		} else {
+			row[0] = '\0';
+		}
+		if (strcmp(infotext[i], row)) {
+			strcpy(infotext[i], row);
+			changed |= 1ULL << i;
 		}
-		strncpy(infotext[info_row], token, MAX_COLS);
-		infotext[info_row][MAX_COLS - 1] = '\0';
 	}
 	pthread_mutex_unlock(&gTextMutex);
 	free(idata);
 
+	if (!changed)
+		return;
+
 	pthread_mutex_lock(&gUpdateMutex);
-	update_screen_locked();
+	mark_info_rows_dirty_locked(changed);
+	flush_screen_locked();
 	pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -675,6 +961,7 @@ void mui_print(const char *fmt, ...)
 {
 	char buf[256];
 	va_list ap;
+	uint64_t rows = 0;
 
 	va_start(ap, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, ap);
@@ -687,6 +974,7 @@ void mui_print(const char *fmt, ...)
 	pthread_mutex_lock(&gTextMutex);
 	if (text_rows > 0 && text_cols > 0) {
 		char *ptr;
+		int first_row = text_row, old_top = text_top, r;
 		if (text_col != 0) {
 			text_col = 0;
 			text_row = (text_row + 1) % text_rows;
@@ -705,14 +993,26 @@ void mui_print(const char *fmt, ...)
 				text[text_row][text_col++] = *ptr;
 		}
 		text[text_row][text_col] = '\0';
+
+		// Only the rows written to need repainting, unless it scrolled
+		if (text_top != old_top) {
+			rows = ~0ULL;
+		} else {
+			for (r = first_row;; r = (r + 1) % text_rows) {
+				rows |= 1ULL << ((r - text_top + text_rows) %
+						 text_rows);
+				if (r == text_row)
+					break;
+			}
+		}
 	}
 	pthread_mutex_unlock(&gTextMutex);
-	if (show_text) {
+	if (show_text && rows) {
 		pthread_mutex_lock(&gUpdateMutex);
-		update_screen_locked();
+		mark_rows_dirty_locked(rows);
+		flush_screen_locked();
 		pthread_mutex_unlock(&gUpdateMutex);
 	}
-
 }
 
 int mui_start_menu(char **headers, char **items, int initial_selection)
@@ -779,6 +1079,7 @@ void mui_end_menu()
 		update_screen_locked();
 	}
 	pthread_mutex_unlock(&gUpdateMutex);
+	kick_progress_thread();
 }
 
 int mui_text_visible()
@@ -797,6 +1098,7 @@ void mui_show_text(int visible)
 	show_text = visible;
 	update_screen_locked();
 	pthread_mutex_unlock(&gUpdateMutex);
+	kick_progress_thread();
 }
 
 int mui_wait_key()
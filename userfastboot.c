@@ -74,6 +74,7 @@ int main(int argc, char **argv)
 
 	klog_init();
 	klog_set_level(7);
+	logger_start();
 
 	OpenSSL_add_all_algorithms();
 	ERR_load_crypto_strings();
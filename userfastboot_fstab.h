@@ -37,5 +37,12 @@ void publish_all_part_data(bool wait);
 // non-removable disk on the device
 char *get_primary_disk_name(void);
 
+// sysfs directory of the whole disk holding a volume, must be freed
+char *get_volume_disk(struct fstab_rec *vol);
+
+// Forget cached volume sizes and disks; call whenever the partition
+// table may have changed
+void storage_catalog_invalidate(void);
+
 #endif
 
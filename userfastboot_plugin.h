@@ -44,6 +44,14 @@ int aboot_register_oem_cmd(char *key, oem_func callback,
  * on the heap; free it after publishing if you need to */
 void fastboot_publish(char *name, char *value);
 
+void fastboot_publish_getter(char *name, fastboot_getter fn, void *ctx,
+		unsigned int ttl_ms);
+
+/* Plugins that write to partitions outside of a registered flash command
+ * must call this so 'oem get-hashes' doesn't report stale digests. NULL
+ * drops everything. */
+void hash_cache_invalidate(const char *ptn);
+
 /* If non-NULL, run this during provisioning checks, which are
  * performed before automatic update packages are applied */
 void set_platform_provision_function(int (*fn)(void));
@@ -25,41 +25,32 @@
 #include <errno.h>
 #include <string.h>
 #include "fastboot.h"
+#include "logger.h"
 
 #define pr_perror(x)	pr_error("%s failed: %s\n", x, strerror(errno))
 
 #define VERBOSE_DEBUG 0
 
-#define pr_error(...) do { \
-	KLOG_ERROR("userfastboot", __VA_ARGS__); \
-	mui_print("E: " __VA_ARGS__); \
-	fastboot_info(__VA_ARGS__); \
-	} while (0)
+#define pr_error(...) \
+	logger_write(LOGGER_ERROR, LOGGER_SCREEN | LOGGER_HOST, __VA_ARGS__)
 
-#define pr_warning(...)		do { \
-	mui_print("W: " __VA_ARGS__); \
-	KLOG_WARNING("userfastboot", __VA_ARGS__); \
-	} while (0)
+#define pr_warning(...) \
+	logger_write(LOGGER_WARNING, LOGGER_SCREEN, __VA_ARGS__)
 
-#define pr_info(...)		do { \
-	KLOG_NOTICE("userfastboot", __VA_ARGS__); \
-	mui_print(__VA_ARGS__); \
-	fastboot_info(__VA_ARGS__); \
-	} while (0)
+#define pr_info(...) \
+	logger_write(LOGGER_NOTICE, LOGGER_SCREEN | LOGGER_HOST, __VA_ARGS__)
 
 #if VERBOSE_DEBUG
 /* Serial console only */
-#define pr_verbose(...)		KLOG_DEBUG("userfastboot", __VA_ARGS__)
+#define pr_verbose(...)		logger_write(LOGGER_DEBUG, 0, __VA_ARGS__)
 #else
 #define pr_verbose(...)		do { } while (0)
 #endif
 
-#define pr_debug(...)		KLOG_INFO("userfastboot", __VA_ARGS__)
+#define pr_debug(...)		logger_write(LOGGER_INFO, 0, __VA_ARGS__)
 
-#define pr_status(...)		do { \
-	KLOG_NOTICE("userfastboot", __VA_ARGS__); \
-	mui_status(__VA_ARGS__); \
-	} while (0)
+#define pr_status(...) \
+	logger_write(LOGGER_NOTICE, LOGGER_STATUS, __VA_ARGS__)
 
 
 // Initialize the graphics system.
@@ -75,6 +66,10 @@ void mui_status(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 // multiple lines of information. Multiple calls reset what is written.
 void mui_infotext(const char *info);
 
+// Writes a single line of transfer statistics under the status line,
+// an empty string clears it.
+void mui_stats(const char *line);
+
 // Set the icon (normally the only thing visible besides the progress bar).
 enum {
 	BACKGROUND_ICON_NONE,
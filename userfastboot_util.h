@@ -32,16 +32,22 @@ int read_sysfs_int64(int64_t *val, const char *fmt, ...) __attribute__ ((format
 char *get_dmi_data(const char *node);
 ssize_t robust_read(int fd, void *buf, size_t count, bool short_ok);
 ssize_t robust_write(int fd, const void *buf, size_t count);
+/* Monotonic clock in milliseconds */
+int64_t now_ms(void);
+/* Read exactly len bytes at offset; logs and returns -1 otherwise */
+int pread_full(int fd, void *buf, size_t len, uint64_t offset);
 
 /* Fails assertion if memory allocations fail */
 char *xstrdup(const char *s);
 char *xasprintf(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
 void xstring_append_line(char **str, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 
 /* struct fstab_rec operations */
 int mount_partition(struct fstab_rec *vol, bool readonly);
 int erase_partition(struct fstab_rec *vol);
+int verify_erased_partition(struct fstab_rec *vol, unsigned int samples);
 int check_ext_superblock(struct fstab_rec *vol, int *sb_present);
 int unmount_partition(struct fstab_rec *vol);
 int get_volume_size(struct fstab_rec *vol, uint64_t *sz);
@@ -43,6 +43,9 @@
 #include <linux/fs.h>
 #include <inttypes.h>
 #include <linux/loop.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
 
 #include <cutils/android_reboot.h>
 #include <bootloader.h>
@@ -59,6 +62,8 @@
 #include "userfastboot_ui.h"
 #include "userfastboot_util.h"
 #include "userfastboot_fstab.h"
+#include "hashes.h"
+#include "xfer_stats.h"
 
 /* make_ext4fs.h can't be included along with linux/ext3_fs.h.
  * This is the only item needed out of the former. */
@@ -70,6 +75,7 @@ void die(void)
 	pr_error("userfastboot has encountered an unrecoverable problem, exiting!\n");
 	mui_set_background(BACKGROUND_ICON_ERROR);
 	mui_show_text(1);
+	logger_flush();
 	exit(1);
 }
 
@@ -92,6 +98,17 @@ void *xmalloc(size_t size)
 }
 
 
+void *xrealloc(void *ptr, size_t size)
+{
+	void *ret = realloc(ptr, size);
+	if (!ret) {
+		pr_error("allocation size: %zd\n", size);
+		die_errno("realloc");
+	}
+	return ret;
+}
+
+
 char *xstrdup(const char *s)
 {
 	char *ret = strdup(s);
@@ -213,12 +230,16 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
 	int64_t pad;
 	unsigned int total_blocks = 0;
 	unsigned int count = 0;
+	uint64_t total_bytes = 0;
 
 	for (bb = backed_block_iter_new(s->backed_block_list); bb;
-			bb = backed_block_iter_next(bb))
+			bb = backed_block_iter_next(bb)) {
 		total_blocks++;
+		total_bytes += backed_block_len(bb);
+	}
 
 	mui_show_progress(1.0, 0);
+	xfer_start(XFER_WRITE, total_bytes);
 
 	for (bb = backed_block_iter_new(s->backed_block_list); bb;
 			bb = backed_block_iter_next(bb)) {
@@ -228,11 +249,13 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
 			write_skip_chunk(out, (int64_t)blocks * s->block_size);
 		}
 		sparse_file_write_block(out, bb);
+		xfer_add(XFER_WRITE, backed_block_len(bb), 0);
 		last_block = backed_block_block(bb) +
 				DIV_ROUND_UP(backed_block_len(bb), s->block_size);
 		count++;
 	}
 
+	xfer_finish(XFER_WRITE);
 	mui_reset_progress();
 	pad = s->len - (int64_t)last_block * s->block_size;
 	if (pad < 0) {
@@ -327,6 +350,7 @@ int named_file_write(const char *filename, const unsigned char *what,
 	}
 
 	mui_show_progress(1.0, 0);
+	xfer_start(XFER_WRITE, sz);
 	pr_verbose("write() %zu bytes to %s\n", sz, filename);
 
 	while (sz) {
@@ -335,6 +359,7 @@ int named_file_write(const char *filename, const unsigned char *what,
 		ret = write(fd, what, min(sz, 1024U * 1024U));
 		if (ret < 0) {
 			if (errno != EINTR) {
+				xfer_finish(XFER_WRITE);
 				mui_reset_progress();
 				pr_error("file_write: Failed to write to %s: %s\n",
 					filename, strerror(errno));
@@ -347,9 +372,11 @@ int named_file_write(const char *filename, const unsigned char *what,
 		what += ret;
 		sz -= ret;
 		count += ret;
+		xfer_add(XFER_WRITE, ret, 0);
 	}
 	fsync(fd);
 	close(fd);
+	xfer_finish(XFER_WRITE);
 	mui_reset_progress();
 	return 0;
 }
@@ -456,33 +483,6 @@ int unmount_loopback(int loop_fd, const char *mountpoint)
 	return (ret < 0);
 }
 
-int get_volume_size(struct fstab_rec *vol, uint64_t *sz)
-{
-	int fd;
-	int ret = -1;
-
-	if (vol->length > 0) {
-		*sz = vol->length;
-		return 0;
-	}
-
-	fd = open(vol->blk_device, O_RDONLY);
-	if (fd < 0) {
-		return -1;
-	}
-
-	if (ioctl(fd, BLKGETSIZE64, sz) >= 0) {
-		ret = 0;
-		*sz += vol->length;
-	} else {
-		pr_perror("BLKGETSIZE64");
-	}
-	pr_verbose("size is %" PRIu64 "\n", *sz);
-	close(fd);
-	return ret;
-}
-
-
 int64_t get_disk_size(const char *disk_name)
 {
 	int64_t disk_sectors, lba_size;
@@ -559,6 +559,7 @@ static int erase_range_zero(int fd, uint64_t start, uint64_t len)
 			return -1;
 		}
 		len -= ret;
+		xfer_add(XFER_ERASE, ret, 0);
 	}
 	return 0;
 }
@@ -598,6 +599,7 @@ static int erase_range(int fd, uint64_t start, uint64_t len)
 		return erase_range_zero(fd, start, len);
 	}
 
+	xfer_add(XFER_ERASE, len, 0);
 	return 0;
 }
 
@@ -636,6 +638,7 @@ int erase_partition(struct fstab_rec *vol)
 	}
 
 	mui_show_indeterminate_progress();
+	xfer_start(XFER_ERASE, disk_size);
 	/* It would be great if we could do BLKSECDISCARD on small regions
 	 * so that we can update the progress bar, but each of these ioctls
 	 * has a very long setup/teardown phase which makes the entire operation
@@ -680,6 +683,7 @@ int erase_partition(struct fstab_rec *vol)
 	}
 	ret = 0;
 out:
+	xfer_finish(XFER_ERASE);
 	mui_reset_progress();
 	free(disk_name);
 	fsync(fd);
@@ -688,6 +692,253 @@ out:
 }
 
 
+/* Post-erase verification. A full read-back of a large partition would
+ * take as long as zeroing it, so instead we read randomly sampled blocks
+ * with O_DIRECT (so we see what the device returns, not the page cache)
+ * on several threads and check that each one reads back as erased. */
+#define VERIFY_BLOCK_SZ		4096
+#define VERIFY_MAX_THREADS	8
+#define VERIFY_MAX_REPORT	16U
+
+struct erase_verify_ctx {
+	int fd;
+	uint64_t nblocks;
+	pthread_mutex_t lock;
+	unsigned int checked;
+	unsigned int bad;
+	uint64_t bad_offsets[VERIFY_MAX_REPORT];
+	bool error;
+};
+
+/* Sample k reads block (start + k * step) % nblocks. With step coprime
+ * to nblocks that visits every block once, so samples never repeat;
+ * each worker takes a run of consecutive k. */
+struct erase_verify_worker {
+	pthread_t thread;
+	struct erase_verify_ctx *ctx;
+	unsigned int samples;
+	uint64_t block;
+	uint64_t step;
+};
+
+/* Depending on the device, discarded blocks read back as all zeroes or
+ * all ones. Accumulate differences without branching so the compiler
+ * can vectorize the loop. */
+static bool block_is_erased(const void *buf, size_t len)
+{
+	const uint64_t *p = buf;
+	uint64_t pattern = p[0];
+	uint64_t acc = 0;
+	size_t i;
+
+	if (pattern != 0 && pattern != ~0ULL)
+		return false;
+
+	for (i = 0; i < len / sizeof(uint64_t); i++)
+		acc |= p[i] ^ pattern;
+
+	return acc == 0;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+	while (b) {
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* (a * b) % m without 128-bit arithmetic; m is a block count, so well
+ * below 2^63 and the additions can't overflow */
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m)
+{
+	uint64_t r = 0;
+
+	a %= m;
+	while (b) {
+		if (b & 1) {
+			r += a;
+			if (r >= m)
+				r -= m;
+		}
+		a += a;
+		if (a >= m)
+			a -= m;
+		b >>= 1;
+	}
+	return r;
+}
+
+static void *erase_verify_thread(void *data)
+{
+	struct erase_verify_worker *w = data;
+	struct erase_verify_ctx *ctx = w->ctx;
+	void *buf;
+	unsigned int i;
+
+	if (posix_memalign(&buf, VERIFY_BLOCK_SZ, VERIFY_BLOCK_SZ)) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->error = true;
+		pthread_mutex_unlock(&ctx->lock);
+		return NULL;
+	}
+
+	for (i = 0; i < w->samples; i++) {
+		uint64_t offset;
+		bool erased;
+
+		offset = w->block * VERIFY_BLOCK_SZ;
+		w->block += w->step;
+		if (w->block >= ctx->nblocks)
+			w->block -= ctx->nblocks;
+		if (pread64(ctx->fd, buf, VERIFY_BLOCK_SZ, offset) != VERIFY_BLOCK_SZ) {
+			pr_error("couldn't read sample at offset %" PRIu64 ": %s\n",
+					offset, strerror(errno));
+			pthread_mutex_lock(&ctx->lock);
+			ctx->error = true;
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		erased = block_is_erased(buf, VERIFY_BLOCK_SZ);
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->checked++;
+		if (!erased) {
+			if (ctx->bad < VERIFY_MAX_REPORT)
+				ctx->bad_offsets[ctx->bad] = offset;
+			ctx->bad++;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+int verify_erased_partition(struct fstab_rec *vol, unsigned int samples)
+{
+	struct erase_verify_ctx ctx;
+	struct erase_verify_worker workers[VERIFY_MAX_THREADS];
+	uint64_t disk_size, seed[2], start, step, first;
+	long ncpus;
+	int nthreads, started, i;
+	int ifd;
+	int ret = -1;
+	double coverage, bound;
+
+	if (!samples) {
+		pr_error("need at least one sample\n");
+		return -1;
+	}
+
+	if (get_volume_size(vol, &disk_size)) {
+		pr_error("couldn't get %s volume size\n", vol->mount_point);
+		return -1;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	pthread_mutex_init(&ctx.lock, NULL);
+	ctx.nblocks = disk_size / VERIFY_BLOCK_SZ;
+	if (!ctx.nblocks) {
+		pr_error("%s is too small to verify\n", vol->mount_point);
+		goto out_lock;
+	}
+
+	ctx.fd = open(vol->blk_device, O_RDONLY | O_DIRECT);
+	if (ctx.fd < 0) {
+		pr_error("couldn't open block device %s\n", vol->blk_device);
+		goto out_lock;
+	}
+
+	if (samples > ctx.nblocks) {
+		pr_info("%s only has %" PRIu64 " blocks to sample\n",
+				vol->mount_point, ctx.nblocks);
+		samples = ctx.nblocks;
+	}
+
+	ifd = open("/dev/urandom", O_RDONLY);
+	if (ifd < 0 || robust_read(ifd, seed, sizeof(seed), false) !=
+			sizeof(seed)) {
+		pr_perror("read /dev/urandom");
+		if (ifd >= 0)
+			close(ifd);
+		goto out_fd;
+	}
+	close(ifd);
+
+	/* Random start and a random stride coprime to nblocks */
+	start = seed[0] % ctx.nblocks;
+	step = seed[1] % ctx.nblocks;
+	if (!step)
+		step = 1;
+	while (gcd(step, ctx.nblocks) != 1)
+		step++;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = (ncpus > 0) ? min(ncpus, (long)VERIFY_MAX_THREADS) : 1;
+	if ((unsigned int)nthreads > samples)
+		nthreads = samples;
+
+	pr_status("Verifying erase of %s (%u samples)...\n",
+			vol->mount_point, samples);
+	mui_show_indeterminate_progress();
+
+	for (started = 0, first = 0; started < nthreads; started++) {
+		struct erase_verify_worker *w = &workers[started];
+
+		w->ctx = &ctx;
+		w->samples = samples / nthreads +
+			((unsigned int)started < samples % nthreads ? 1 : 0);
+		w->block = (start + mulmod(first, step, ctx.nblocks)) %
+			ctx.nblocks;
+		w->step = step;
+		first += w->samples;
+		if (pthread_create(&w->thread, NULL, erase_verify_thread, w)) {
+			pr_perror("pthread_create");
+			ctx.error = true;
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	mui_reset_progress();
+
+	if (ctx.error) {
+		pr_error("erase verification of %s incomplete\n", vol->mount_point);
+		goto out_fd;
+	}
+
+	/* Samples are distinct blocks, so this is the share actually read.
+	 * If a fraction f of the partition were not erased, the chance that
+	 * all n samples miss it is at most (1 - f)^n. Report the f we can
+	 * rule out with 99% confidence. */
+	coverage = 100.0 * ctx.checked / ctx.nblocks;
+	bound = 100.0 * (1.0 - pow(0.01, 1.0 / ctx.checked));
+	pr_info("checked %u blocks (%.4f%% of %s)\n", ctx.checked,
+			coverage, vol->mount_point);
+
+	if (ctx.bad) {
+		pr_error("%u of %u sampled blocks are not erased\n",
+				ctx.bad, ctx.checked);
+		for (i = 0; i < (int)min(ctx.bad, VERIFY_MAX_REPORT); i++)
+			pr_error("non-erased block at offset 0x%" PRIx64 "\n",
+					ctx.bad_offsets[i]);
+		goto out_fd;
+	}
+
+	pr_info("all samples erased; <%.3f%% unerased at 99%% confidence\n",
+			bound);
+	ret = 0;
+out_fd:
+	close(ctx.fd);
+out_lock:
+	pthread_mutex_destroy(&ctx.lock);
+	return ret;
+}
+
+
 int execute_command(const char *fmt, ...)
 {
 	int ret = -1;
@@ -853,6 +1104,36 @@ ssize_t robust_read(int fd, void *buf, size_t count, bool short_ok)
 	return total;
 }
 
+int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int pread_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+	unsigned char *pos = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pread64(fd, pos, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_error("read at offset %" PRIu64 " failed: %s\n",
+					offset, ret ? strerror(errno) :
+					"unexpected EOF");
+			return -1;
+		}
+		pos += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
 static char *__read_sysfs(const char *fmt, va_list ap)
 {
 	int fd;
@@ -943,6 +1224,7 @@ int copy_bootloader_file(char *filename, void *data, unsigned sz)
 		return -1;
 	}
 
+	hash_cache_invalidate("bootloader");
 	destpath = xasprintf("/mnt/bootloader/%s", filename);
 	if (named_file_write(destpath, data, sz, 0, 0)) {
 		pr_error("Couldn't write image to bootloader partition.\n");
@@ -970,6 +1252,7 @@ int update_bcb(char *command)
 
 	memset(&bcb, 0, sizeof(bcb));
 	strncpy(bcb.command, command, sizeof(bcb.command)-1);
+	hash_cache_invalidate("misc");
 	if (named_file_write(vol_misc->blk_device, (void *)&bcb, sizeof(bcb), 0, 0)) {
 		pr_error("Couldn't update BCB!\n");
 		return -1;
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "xfer_stats.h"
+#include "fastboot.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+/* The rate is sampled at most this often, and averaged over roughly
+ * the last XFER_WINDOW_MS so a stall shows up within a few seconds */
+#define XFER_SAMPLE_MS	250
+#define XFER_WINDOW_MS	3000
+
+#define MB		1000000
+
+struct xfer_state {
+	const char *name;
+	bool active;
+	bool ran;
+	uint64_t done;
+	uint64_t total;
+	int64_t start;
+	int64_t end;
+	int64_t sample_time;
+	uint64_t sample_done;
+	double rate;		/* bytes per ms, moving average */
+};
+
+static struct xfer_state phases[XFER_NUM_PHASES] = {
+	[XFER_DOWNLOAD] = { .name = "download" },
+	[XFER_WRITE] = { .name = "write" },
+	[XFER_ERASE] = { .name = "erase" },
+	[XFER_HASH] = { .name = "hash" },
+};
+
+static struct xfer_state *last_phase;
+static pthread_mutex_t xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* bytes per ms to MB/s */
+static double mb_per_sec(double rate)
+{
+	return rate * 1000 / MB;
+}
+
+/* Should only be called with xfer_lock held */
+static void sample_rate(struct xfer_state *s, int64_t now)
+{
+	double dt = now - s->sample_time;
+	double rate = (s->done - s->sample_done) / dt;
+
+	/* Exponential moving average; weighting by dt keeps the window
+	 * the same however unevenly the samples arrive */
+	if (s->rate > 0)
+		s->rate += (rate - s->rate) * dt / (XFER_WINDOW_MS + dt);
+	else
+		s->rate = rate;
+	s->sample_time = now;
+	s->sample_done = s->done;
+}
+
+/* Should only be called with xfer_lock held */
+static char *describe(struct xfer_state *s)
+{
+	char *size, *eta, *ret;
+	int64_t elapsed;
+
+	if (!s->ran)
+		return xasprintf("%s idle", s->name);
+
+	/* A phase that stopped short shows how far it got */
+	if (s->total > s->done)
+		size = xasprintf("%" PRIu64 "/%" PRIu64 " MB",
+				s->done / MB, s->total / MB);
+	else
+		size = xasprintf("%" PRIu64 " MB", s->done / MB);
+
+	if (!s->active) {
+		elapsed = s->end - s->start;
+		ret = xasprintf("%s %s in %" PRId64 ".%01" PRId64 "s, %.1f MB/s",
+				s->name, size, elapsed / 1000,
+				(elapsed % 1000) / 100, elapsed ?
+				mb_per_sec((double)s->done / elapsed) : 0);
+		free(size);
+		return ret;
+	}
+
+	if (s->rate > 0 && s->total > s->done) {
+		int64_t secs = (s->total - s->done) / s->rate / 1000;
+		eta = xasprintf(", ETA %" PRId64 ":%02" PRId64,
+				secs / 60, secs % 60);
+	} else {
+		eta = xstrdup("");
+	}
+
+	ret = xasprintf("%s %.1f MB/s, %s%s", s->name,
+			mb_per_sec(s->rate), size, eta);
+	free(size);
+	free(eta);
+	return ret;
+}
+
+void xfer_start(enum xfer_phase phase, uint64_t total)
+{
+	struct xfer_state *s = &phases[phase];
+	int64_t now = now_ms();
+
+	pthread_mutex_lock(&xfer_lock);
+	s->active = true;
+	s->ran = true;
+	s->done = 0;
+	s->total = total;
+	s->start = now;
+	s->sample_time = now;
+	s->sample_done = 0;
+	s->rate = 0;
+	last_phase = s;
+	pthread_mutex_unlock(&xfer_lock);
+}
+
+void xfer_add(enum xfer_phase phase, uint64_t done, uint64_t total)
+{
+	struct xfer_state *s = &phases[phase];
+	int64_t now = now_ms();
+	char *line = NULL;
+
+	pthread_mutex_lock(&xfer_lock);
+	s->done += done;
+	s->total += total;
+	if (s->active && now - s->sample_time >= XFER_SAMPLE_MS) {
+		sample_rate(s, now);
+		line = describe(s);
+	}
+	pthread_mutex_unlock(&xfer_lock);
+
+	if (line) {
+		mui_stats(line);
+		free(line);
+	}
+}
+
+void xfer_finish(enum xfer_phase phase)
+{
+	struct xfer_state *s = &phases[phase];
+	char *line;
+
+	pthread_mutex_lock(&xfer_lock);
+	if (!s->active) {
+		pthread_mutex_unlock(&xfer_lock);
+		return;
+	}
+	s->active = false;
+	s->end = now_ms();
+	last_phase = s;
+	line = describe(s);
+	pthread_mutex_unlock(&xfer_lock);
+
+	pr_debug("%s\n", line);
+	free(line);
+	mui_stats("");
+}
+
+static char *get_xfer_stats(const char *name, void *ctx)
+{
+	struct xfer_state *s;
+	char *ret;
+
+	pthread_mutex_lock(&xfer_lock);
+	s = ctx ? ctx : last_phase;
+	ret = s ? describe(s) : xstrdup("idle");
+	pthread_mutex_unlock(&xfer_lock);
+	return ret;
+}
+
+void xfer_stats_init(void)
+{
+	char *name;
+	int i;
+
+	fastboot_publish_getter("xfer-stats", get_xfer_stats, NULL, 0);
+	for (i = 0; i < XFER_NUM_PHASES; i++) {
+		name = xasprintf("xfer-stats:%s", phases[i].name);
+		fastboot_publish_getter(name, get_xfer_stats, &phases[i], 0);
+		free(name);
+	}
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
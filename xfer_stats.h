@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_XFER_STATS_H_
+#define _USERFASTBOOT_XFER_STATS_H_
+
+#include <stdint.h>
+
+/* Throughput and ETA for the long running loops. Each phase keeps a
+ * moving average of its MB/s, shown under the status line while it runs
+ * and published as getvar "xfer-stats:<phase>"; "xfer-stats" is
+ * whichever phase ran last. */
+enum xfer_phase {
+	XFER_DOWNLOAD,
+	XFER_WRITE,
+	XFER_ERASE,
+	XFER_HASH,
+	XFER_NUM_PHASES
+};
+
+/* Begin a phase expected to move total bytes, 0 if not yet known */
+void xfer_start(enum xfer_phase phase, uint64_t total);
+
+/* Account for done more bytes moved, and total more bytes expected.
+ * Safe to call from several threads at once. */
+void xfer_add(enum xfer_phase phase, uint64_t done, uint64_t total);
+
+/* End the phase; its final average stays visible over getvar */
+void xfer_finish(enum xfer_phase phase);
+
+/* Publish the xfer-stats fastboot variables */
+void xfer_stats_init(void);
+
+#endif